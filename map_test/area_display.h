@@ -30,38 +30,46 @@ namespace area {
             delete temp;
 		}
 
-        void draw_area(Area* a, double x1, double y1, bool resize = true, bool has_temp = false, bool fill = true) {
+        // Parts of the areas to draw, fills may go to a FillSink while outlines are drawn over them later
+        enum Parts { FILL = 1, OUTLINE = 2, ALL = FILL | OUTLINE };
+
+        void draw_area(Area* a, double x1, double y1, bool resize = true, bool has_temp = false, bool fill = true,
+            int parts = ALL, const FillSink& sink = {}) {
             if (!a->visible()) {
                 return;
             }
             if (a->is_clipped(lng, lat, x1, y1) && !has_temp) {
-                if (a->points_count()) {
+                if ((parts & OUTLINE) && a->points_count()) {
                     auto [cx, cy] = cursor_mercator(Map::w / 2, Map::h / 2);
                     a->indicator(cx, cy, Map::w, Map::h);
                 }
-                if (resize) {
+                if ((parts & FILL) && resize) {
                     a->reset_anchor();
                 }
                 return;
             }
-            if (fill_areas && fill) {
-                a->fill(lng, lat, x1, y1, resize, has_temp);
-            } else if (resize) {
-                a->reset_anchor();
+            if (parts & FILL) {
+                if (fill_areas && fill) {
+                    a->fill(lng, lat, x1, y1, resize, has_temp, sink);
+                } else if (resize) {
+                    a->reset_anchor();
+                }
+            }
+            if (parts & OUTLINE) {
+                a->outline(lng, lat, pixels_per_side, has_temp);
             }
-            a->outline(lng, lat, pixels_per_side, has_temp);
         }
 
-		void draw_areas(bool resize = true) {
+		void draw_areas(bool resize = true, int parts = ALL, const FillSink& sink = {}) {
             auto [x1, y1] = cursor_mercator(Map::w, Map::h);
             if (temp) {
-                draw_area(temp, x1, y1, true, true);
+                draw_area(temp, x1, y1, true, true, true, parts, sink);
                 for (auto& a : areas) {
-                    draw_area(&a, x1, y1, resize, false, false);
+                    draw_area(&a, x1, y1, resize, false, false, parts, sink);
                 }
             } else {
                 for (auto& a : areas) {
-                    draw_area(&a, x1, y1, resize);
+                    draw_area(&a, x1, y1, resize, false, true, parts, sink);
                 }
             }
 		}
@@ -7,8 +7,12 @@
 //
 
 #include "polygon.h"
+#include "metrics.h"
+#include "resample.h"
 
 namespace area {
+    // Receives a fill image and its position on screen in place of drawing it
+    using FillSink = std::function<void(const Fl_Image*, int, int)>;
 
     // Class of polygonal areas on map
     class Area : public Polygon {
@@ -28,8 +32,10 @@ namespace area {
         std::string tag;
 
     public:
-        // Fill area with its color
-        void fill(double x1, double y1, double x2, double y2, bool resize = true, bool has_temp = false) {
+        // Fill area with its color, handing the image to `sink` when given
+        void fill(double x1, double y1, double x2, double y2, bool resize = true, bool has_temp = false,
+            const FillSink& sink = {}) {
+            auto place = [&](int x, int y) { sink ? sink(image, x, y) : image->draw(x, y); };
             if (polygon.size() < 2 || polygon.size() < 3 && !has_temp) {
                 return;
             }
@@ -39,12 +45,12 @@ namespace area {
                 anchor = { 0,0 };
             } else if (anchor.y > EPSILON) {
                 // Have anchor - draw image in relative posision
-                image->draw(static_cast<int>((anchor.x - x1) / dx * display_w), static_cast<int>((anchor.y - y1) / dy * display_h));
+                place(static_cast<int>((anchor.x - x1) / dx * display_w), static_cast<int>((anchor.y - y1) / dy * display_h));
                 return;
             }
             if (!has_temp && is_fit(dx, dy)) {
                 generate_img(bbox1.x, bbox1.y, dx, dy, has_temp);
-                image->draw(static_cast<int>((bbox1.x - x1) / dx * display_w), static_cast<int>((bbox1.y - y1) / dy * display_h));
+                place(static_cast<int>((bbox1.x - x1) / dx * display_w), static_cast<int>((bbox1.y - y1) / dy * display_h));
 #if DEBUG
                 std::cout << "Anchor dropped" << std::endl;
 #endif // DEBUG
@@ -53,7 +59,7 @@ namespace area {
                 return;
             }
             generate_img(x1, y1, dx, dy, has_temp);
-            image->draw(0, 0);
+            place(0, 0);
         }
 
         // Trace the outline of the area
@@ -123,7 +129,15 @@ namespace area {
 
     protected:
         void generate_img(double x1, double y1, double dx, double dy, bool has_temp = false) {
-            std::fill(img_data, img_data + data_size, 0);
+            static auto& raster_time = metrics::registry().histogram("areas.raster_us");
+            metrics::ScopedTimer timer(raster_time);
+            // Transparent pixels take the area colour, so scaling only blends alpha at the edges
+            for (size_t i = 0; i < data_size; i += 4) {
+                img_data[i] = cR;
+                img_data[i + 1] = cG;
+                img_data[i + 2] = cB;
+                img_data[i + 3] = 0;
+            }
             for (size_t j = 0; j < img_h; j++) {
                 double y = dy * j / img_h + y1;
                 // Begin status of start point and the set of intersections along the ray
@@ -154,8 +168,12 @@ namespace area {
                 }
             }
             delete image;
-            Fl_RGB_Image img(img_data, static_cast<int>(img_w), static_cast<int>(img_h), 4);
-            image = img.copy(static_cast<int>(display_w), static_cast<int>(display_h));
+            auto scaled = new uchar[display_w * display_h * 4];
+            resample::scale(img_data, static_cast<int>(img_w), static_cast<int>(img_h), static_cast<int>(img_w * 4), 4,
+                scaled, static_cast<int>(display_w), static_cast<int>(display_h));
+            auto img = new Fl_RGB_Image(scaled, static_cast<int>(display_w), static_cast<int>(display_h), 4);
+            img->alloc_array = 1;
+            image = img;
         }
 
     public:
@@ -0,0 +1,122 @@
+#pragma once
+//
+//  band_pool.h
+//
+//  Worker pool rendering a frame in horizontal bands
+//  Bands are dealt out to the workers in contiguous runs, a worker out of bands steals from the others,
+//  so uneven bands (tilts still loading, areas covering part of the screen) keep every core busy
+//
+
+#include "metrics.h"
+
+namespace raster {
+    // Rows per band, small enough for stealing to even out the load and large enough for filtering to pay off
+    const int BAND_ROWS = 32;
+
+    // Default number of threads rendering a frame, the calling thread included
+    inline int default_threads() { return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1); }
+
+    class BandPool {
+        // Bands [next, end) left to a thread, taken from the front by their owner and by thieves alike
+        struct alignas(64) Run {
+            std::atomic<int> next = 0;
+            int end = 0;
+        };
+
+        std::vector<std::thread> workers;
+        std::unique_ptr<Run[]> runs;
+        std::mutex mtx;
+        std::condition_variable start, finished;
+        const std::function<void(int)>* job = nullptr;
+        uint64_t generation = 0;
+        int running = 0;
+        bool stopping = false;
+        metrics::Counter& stolen = metrics::registry().counter("raster.bands_stolen");
+
+        int threads() const { return static_cast<int>(workers.size()) + 1; }
+
+        // Render bands of thread `self`, then steal the remaining bands of the others
+        void drain(int self) {
+            int n = threads();
+            for (int k = 0; k < n; k++) {
+                auto& r = runs[(self + k) % n];
+                for (int b; (b = r.next.fetch_add(1, std::memory_order_relaxed)) < r.end;) {
+                    (*job)(b);
+                    if (k) {
+                        stolen.add();
+                    }
+                }
+            }
+        }
+
+        void work(int self) {
+            uint64_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    start.wait(lock, [&] { return stopping || generation != seen; });
+                    if (stopping) {
+                        return;
+                    }
+                    seen = generation;
+                }
+                drain(self);
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (--running == 0) {
+                        finished.notify_one();
+                    }
+                }
+            }
+        }
+
+    public:
+        BandPool(int threads = default_threads()) : runs(new Run[std::max(threads, 1)]) {
+            for (int i = 1; i < threads; i++) {
+                workers.emplace_back(&BandPool::work, this, i);
+            }
+        }
+
+        ~BandPool() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            start.notify_all();
+            for (auto& th : workers) {
+                th.join();
+            }
+        }
+
+        int size() const { return threads(); }
+
+        // Call `fn(y0, y1)` for the bands of rows [0, rows), returning when every band is done
+        // Bands run on the calling thread too, and in one go when there is nothing to share
+        void run(int rows, const std::function<void(int, int)>& fn, int band = BAND_ROWS) {
+            int bands = (rows + band - 1) / band;
+            if (bands <= 0) {
+                return;
+            }
+            if (workers.empty() || bands == 1) {
+                fn(0, rows);
+                return;
+            }
+            std::function<void(int)> each = [&](int b) { fn(b * band, std::min(rows, (b + 1) * band)); };
+            int n = threads();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (int i = 0; i < n; i++) {
+                    runs[i].next.store(bands * i / n, std::memory_order_relaxed);
+                    runs[i].end = bands * (i + 1) / n;
+                }
+                job = &each;
+                running = n - 1;
+                generation++;
+            }
+            start.notify_all();
+            drain(0);
+            std::unique_lock<std::mutex> lock(mtx);
+            finished.wait(lock, [this] { return running == 0; });
+        }
+    };
+} // namespace raster
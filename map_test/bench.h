@@ -0,0 +1,395 @@
+#pragma once
+//
+//  bench.h
+//
+//  Benchmarks, run instead of the map when BENCHMARK is set
+//
+
+#include "tilts.h"
+#include "tilts_synth.h"
+#include "lru_cache.h"
+#include "resample.h"
+#include "map_display.h"
+
+namespace bench {
+    using clock = std::chrono::steady_clock;
+
+    inline double elapsed_ns(clock::time_point since, size_t ops) {
+        return std::chrono::duration<double, std::nano>(clock::now() - since).count() / ops;
+    }
+
+    // Random tilts around a moving viewport: mostly lookups, a miss is followed by an insert
+    inline std::vector<tilts::TiltId> tilt_trace(size_t ops, int spread) {
+        std::mt19937 rng(42);
+        std::vector<tilts::TiltId> trace;
+        int cx = 1 << 14, cy = 1 << 13;
+        for (size_t i = 0; i < ops; i++) {
+            if (i % 64 == 0) {
+                cx += rng() % 3 - 1, cy += rng() % 3 - 1;
+            }
+            trace.push_back({ .x = cx + int(rng() % spread), .y = cy + int(rng() % spread), .z = 15 });
+        }
+        return trace;
+    }
+
+    // LruCache against the std::map + std::list pair it replaced
+    inline void lru(size_t capacity = 750, size_t ops = 2000000) {
+        auto trace = tilt_trace(ops, 40);
+        size_t hits = 0;
+
+        // Baseline: ordered map with an insertion-ordered eviction list
+        std::map<tilts::TiltId, int> map;
+        std::list<tilts::TiltId> order;
+        auto t0 = clock::now();
+        for (auto& id : trace) {
+            if (map.find(id) != map.end()) {
+                hits += map[id];
+                continue;
+            }
+            while (order.size() >= capacity) {
+                map.erase(order.front());
+                order.pop_front();
+            }
+            order.push_back(id);
+            map[id] = 1;
+        }
+        double map_ns = elapsed_ns(t0, ops);
+        size_t map_hits = hits;
+
+        hits = 0;
+        cache::LruCache<int> lru(capacity);
+        t0 = clock::now();
+        for (auto& id : trace) {
+            if (auto v = lru.find(id.key())) {
+                hits += *v;
+                continue;
+            }
+            lru.put(id.key(), 1);
+        }
+        double lru_ns = elapsed_ns(t0, ops);
+
+        std::cout << "lru: capacity " << capacity << ", " << ops << " ops" << std::endl
+            << "  std::map + std::list  " << std::setw(8) << std::fixed << std::setprecision(1) << map_ns
+            << " ns/op, hit ratio " << std::setprecision(3) << double(map_hits) / ops << std::endl
+            << "  cache::LruCache       " << std::setw(8) << std::setprecision(1) << lru_ns
+            << " ns/op, hit ratio " << std::setprecision(3) << double(hits) / ops << std::endl;
+    }
+
+    // Scaling a tilt to zoom factors in [1, 2): Fl_Image::copy against resample::scale
+    inline void resampling(int reps = 200) {
+        const int size = tilts::TILT_SIZE, d = 3;
+        std::mt19937 rng(7);
+        std::vector<uchar> pixels(static_cast<size_t>(size) * size * d), out;
+        for (auto& p : pixels) {
+            p = static_cast<uchar>(rng());
+        }
+        Fl_RGB_Image tilt(pixels.data(), size, size, d);
+        std::cout << "resampling: " << size << " px RGB tilts, vectorized with " << resample::instruction_set() << std::endl
+            << "      k   Fl_Image::copy     scalar  vectorized  (us per tilt)" << std::endl;
+        for (double k : { 1.0, 1.25, 1.5, 1.75, 1.95 }) {
+            int px = static_cast<int>(size * k);
+            out.resize(static_cast<size_t>(px) * px * d);
+            auto t0 = clock::now();
+            for (int i = 0; i < reps; i++) {
+                delete tilt.copy(px, px);
+            }
+            double copy_us = elapsed_ns(t0, reps) / 1000;
+            double us[2];
+            for (int v = 0; v < 2; v++) {
+                t0 = clock::now();
+                for (int i = 0; i < reps; i++) {
+                    resample::scale(pixels.data(), size, size, size * d, d, out.data(), px, px, v == 1);
+                }
+                us[v] = elapsed_ns(t0, reps) / 1000;
+            }
+            std::cout << "  " << std::setw(5) << std::fixed << std::setprecision(2) << k << std::setprecision(1)
+                << std::setw(17) << copy_us << std::setw(11) << us[0] << std::setw(12) << us[1] << std::endl;
+        }
+    }
+
+    // Peak resident memory of the process in bytes
+    inline size_t peak_rss() {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS pmc;
+        return GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ? pmc.PeakWorkingSetSize : 0;
+#else
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+    }
+
+    inline double percentile(std::vector<double> v, double p) {
+        if (v.empty()) {
+            return 0;
+        }
+        std::sort(v.begin(), v.end());
+        return v[std::min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+    }
+
+    struct TileServerConfig {
+        int servers = 2;
+        double latency_ms = 60, jitter_ms = 40;
+        // Share of requests answered with 503
+        double error_rate = 0.02;
+        size_t png_bytes = 20000;
+    };
+
+    // Local stand-in for the tile server, serving synthetic tilts
+    class TileServer {
+        std::vector<std::unique_ptr<httplib::Server>> servers;
+        std::vector<std::thread> threads;
+
+    public:
+        std::vector<std::string> hosts;
+        std::atomic<uint64_t> requests = 0, errors = 0, bytes = 0;
+
+        TileServer(const TileServerConfig& cfg) {
+            for (int i = 0; i < cfg.servers; i++) {
+                auto svr = std::make_unique<httplib::Server>();
+                svr->Get("/appmaptile", [this, cfg](const httplib::Request& req, httplib::Response& res) {
+                    thread_local std::mt19937 rng(std::random_device{}());
+                    std::uniform_real_distribution<double> u(0, 1);
+                    double delay = cfg.latency_ms + (u(rng) * 2 - 1) * cfg.jitter_ms;
+                    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(std::max(delay, 0.0)));
+                    requests++;
+                    if (u(rng) < cfg.error_rate) {
+                        errors++;
+                        res.status = 503;
+                        return;
+                    }
+                    tilts::TiltId id{ .x = std::stoi(req.get_param_value("x")), .y = std::stoi(req.get_param_value("y")),
+                        .z = std::stoi(req.get_param_value("z")) };
+                    auto png = tilts::synthetic_png(id, cfg.png_bytes);
+                    bytes += png.size();
+                    res.set_content(png, "image/png");
+                });
+                int port = svr->bind_to_any_port("127.0.0.1");
+                hosts.push_back("http://127.0.0.1:" + std::to_string(port));
+                threads.emplace_back([s = svr.get()] { s->listen_after_bind(); });
+                servers.push_back(std::move(svr));
+            }
+            for (auto& s : servers) {
+                s->wait_until_ready();
+            }
+        }
+
+        ~TileServer() {
+            for (auto& s : servers) {
+                s->stop();
+            }
+            for (auto& th : threads) {
+                th.join();
+            }
+        }
+    };
+
+    // Every visible tilt decoded leaves none missing, whatever the grid holds beyond the screen
+    // Returns whether the check passed at each of a few views
+    inline bool viewport_complete(double timeout = 20) {
+        auto win = new Fl_Double_Window(1000, 800, "Benchmark");
+        auto m = new map::Fl_Map(0, 0, 1000, 800, std::make_unique<tilts::SyntheticProvider>(20000));
+        win->end();
+        win->show();
+
+        bool ok = true;
+        auto check = [&](const char* view) {
+            // Loading settles once nothing is pending over a few frames in a row
+            auto t0 = clock::now();
+            for (int idle = 0; idle < 5 && clock::now() - t0 < std::chrono::duration<double>(timeout);) {
+                auto [pending, arrived] = m->poll_futures();
+                idle = pending || arrived ? 0 : idle + 1;
+                Fl::flush();
+                Fl::wait(0.005);
+            }
+            int missing = m->missing_tilts();
+            std::cout << "  " << std::left << std::setw(18) << view << std::right
+                << (missing ? "FAILED, " + std::to_string(missing) + " tilts missing" : std::string("ok")) << std::endl;
+            ok = ok && !missing;
+        };
+        std::cout << "viewport complete check:" << std::endl;
+        check("initial view");
+        m->drag_screen_by(-123, -77);
+        check("panned");
+        for (int i = 0; i < 5; i++) {
+            m->scroll_by(-3, 500, 400);
+        }
+        check("zoomed in");
+
+        delete m;
+        delete win;
+        return ok;
+    }
+
+    // Scripted interaction: a pan of (dx, dy) pixels or `wheel` zoom ticks, spread over `frames` frames
+    struct Step {
+        const char* name;
+        int dx, dy, wheel, frames;
+    };
+
+    const std::vector<Step> SCRIPT = {
+        { "initial view", 0, 0, 0, 1 },
+        { "pan east", -800, 0, 0, 20 },
+        { "pan south", 0, -600, 0, 15 },
+        { "zoom in", 0, 0, -14, 14 },
+        { "zoom in", 0, 0, -14, 14 },
+        { "fling north-west", 1500, 900, 0, 10 },
+        { "zoom out", 0, 0, 28, 14 },
+        { "pan back", 600, -300, 0, 20 },
+    };
+
+    // Replay SCRIPT against a map loading from `source`
+    // Reports time to complete the viewport after each step and peak memory, `report` adds to it before teardown
+    // Returns whether every step completed before the timeout
+    inline bool replay(std::unique_ptr<tilts::TiltProvider> source, double timeout, const std::function<void()>& report) {
+        auto win = new Fl_Double_Window(1000, 800, "Benchmark");
+        auto m = new map::Fl_Map(0, 0, 1000, 800, std::move(source));
+        win->end();
+        win->show();
+
+        size_t peak_cache = 0;
+        auto frame = [&] {
+            m->poll_futures();
+            Fl::flush();
+            Fl::wait(0.005);
+            auto u = m->cache_usage();
+            peak_cache = std::max(peak_cache, u.tilts + u.images);
+        };
+
+        auto start = clock::now();
+        std::vector<double> completes;
+        int timeouts = 0;
+        for (auto& step : SCRIPT) {
+            auto t0 = clock::now();
+            for (int f = 0; f < step.frames; f++) {
+                if (step.wheel) {
+                    m->scroll_by(step.wheel / step.frames, 500, 400);
+                } else {
+                    m->drag_screen_by(step.dx / step.frames, step.dy / step.frames);
+                }
+                frame();
+            }
+            frame();
+            while (m->missing_tilts() && clock::now() - t0 < std::chrono::duration<double>(timeout)) {
+                frame();
+            }
+            double ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+            completes.push_back(ms);
+            std::cout << "  " << std::left << std::setw(18) << step.name << std::right << std::setw(9)
+                << std::fixed << std::setprecision(1) << ms << " ms" << std::endl;
+            if (m->missing_tilts()) {
+                timeouts++;
+                std::cerr << "  FAILED: " << step.name << " timed out with " << m->missing_tilts() << " tilts missing" << std::endl;
+            }
+        }
+        double total = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        std::cout << "  viewport complete: mean " << std::accumulate(completes.begin(), completes.end(), 0.0) / completes.size()
+            << " ms, max " << *std::max_element(completes.begin(), completes.end()) << " ms, total " << total << " ms" << std::endl;
+        report();
+        std::cout << "  peak memory: caches " << peak_cache / 1024 << " KiB, process " << peak_rss() / 1024 << " KiB" << std::endl;
+        if (timeouts) {
+            std::cerr << "  FAILED: " << timeouts << " of " << SCRIPT.size()
+                << " steps timed out, their times are the timeout and not the load time" << std::endl;
+        }
+
+        delete m;
+        delete win;
+        return !timeouts;
+    }
+
+    // Tilts from a local tile server: tilt latency, bytes and download counts on top of the replay
+    inline bool tile_loading(const TileServerConfig& cfg = {}, double timeout = 20) {
+        TileServer server(cfg);
+        std::vector<double> latencies;
+
+        // No disk cache, every tilt is loaded over the network
+        auto http = new tilts::HttpProvider(server.hosts);
+        http->on_download = [&](tilts::TiltId, int status, double seconds, size_t) {
+            if (status == 200) {
+                latencies.push_back(seconds * 1000);
+            }
+        };
+        std::cout << "tile loading: " << cfg.servers << " servers, " << cfg.latency_ms << " +- " << cfg.jitter_ms
+            << " ms, " << cfg.error_rate * 100 << "% errors, " << cfg.png_bytes << " byte tilts" << std::endl;
+        return replay(std::make_unique<tilts::MemoryProvider>(tilts::MEMORY_CACHE_SIZE, std::unique_ptr<tilts::TiltProvider>(http)),
+            timeout, [&] {
+                auto& stats = http->downloadStats();
+                std::cout << "  tilt latency: p50 " << percentile(latencies, 0.5) << " ms, p99 " << percentile(latencies, 0.99)
+                    << " ms over " << latencies.size() << " tilts" << std::endl
+                    << "  transferred " << stats.bytes / 1024 << " KiB in " << server.requests << " requests, "
+                    << stats.failed << " failed, " << stats.retried << " retried, " << stats.cancelled << " cancelled" << std::endl;
+            });
+    }
+
+    // Tilts generated in place: decoding and drawing alone, without the network
+    inline bool synthetic_loading(size_t png_bytes = 20000, double timeout = 20) {
+        std::cout << "synthetic tilts: " << png_bytes << " byte tilts" << std::endl;
+        return replay(std::make_unique<tilts::SyntheticProvider>(png_bytes), timeout, [] {});
+    }
+
+    // Frames at a fractional zoom over the base layer, then rendered in bands on a growing number of threads
+    // Each path is timed re-rendering everything and panning by a pixel, which only scrolls the base layer
+    // Returns whether the view loaded before timing
+    inline bool rasterizing(int frames = 100) {
+        auto win = new Fl_Double_Window(1000, 800, "Benchmark");
+        auto m = new map::Fl_Map(0, 0, 1000, 800, std::make_unique<tilts::SyntheticProvider>(20000));
+        win->end();
+        win->show();
+        m->scroll_by(-3, 500, 400);
+        auto t0 = clock::now();
+        do {
+            m->poll_futures();
+            Fl::flush();
+            Fl::wait(0.005);
+        } while (m->missing_tilts() && clock::now() - t0 < std::chrono::seconds(20));
+        bool loaded = !m->missing_tilts();
+        if (!loaded) {
+            std::cerr << "rasterizing: FAILED, " << m->missing_tilts() << " tilts still missing after 20 s" << std::endl;
+        }
+
+        auto frame_ms = [&](bool pan) {
+            auto t = clock::now();
+            for (int f = 0; f < frames; f++) {
+                if (pan) {
+                    m->drag_screen_by(f % 2 ? 1 : -1, 0);
+                } else {
+                    m->invalidate();
+                }
+                Fl::flush();
+            }
+            return elapsed_ns(t, frames) / 1e6;
+        };
+        auto line = [&](const std::string& name, double full, double pan) {
+            std::cout << "  " << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(2)
+                << std::setw(10) << full << std::setw(10) << pan << std::endl;
+        };
+        std::cout << "rasterizing: " << frames << " frames at k = " << std::setprecision(3) << m->k << std::endl
+            << std::setw(14) << "" << std::setw(10) << "full" << std::setw(10) << "pan" << "  (ms per frame)" << std::endl;
+        line("base layer", frame_ms(false), frame_ms(true));
+        double one = 0;
+        for (int threads = 1; threads <= raster::default_threads(); threads *= 2) {
+            m->set_raster_threads(threads);
+            double full = frame_ms(false);
+            line(std::to_string(threads) + " threads", full, frame_ms(true));
+            one = threads == 1 ? full : one;
+            std::cout << "    full frame speedup over 1 thread " << std::setprecision(2) << one / full << "x" << std::endl;
+        }
+        std::cout << "  bands stolen: " << metrics::registry().counter("raster.bands_stolen").value() << std::endl;
+
+        delete m;
+        delete win;
+        return loaded;
+    }
+
+    inline int run() {
+        if (!viewport_complete()) {
+            return 1;
+        }
+        lru();
+        resampling();
+        bool ok = rasterizing();
+        ok = synthetic_loading() && ok;
+        ok = tile_loading() && ok;
+        return ok ? 0 : 1;
+    }
+} // namespace bench
@@ -0,0 +1,174 @@
+#pragma once
+//
+//  compositor.h
+//
+//  Composition of native tilts into the map
+//  Tilts of one level are copied unscaled into a canvas, which is scaled to the screen in a single pass,
+//  so fractional zoom costs one resample per frame and tilt edges line up without seams
+//  Composing, scaling and blending area fills can be split into horizontal bands over a BandPool
+//
+
+#include "resample.h"
+#include "band_pool.h"
+
+namespace map {
+    // Colour of the map where no tilt is drawn
+    const uchar BACKGROUND[3] = { 252, 249, 242 };
+
+    class Compositor {
+        static const int D = 3;
+
+        // Region of an image copied to a native rectangle, done when the canvas is drawn
+        struct Blit {
+            const Fl_Image* img;
+            int sx, sy, sw, sh, x, y, w, h;
+        };
+        // Image alpha blended over the screen at (x, y)
+        struct Overlay {
+            const Fl_Image* img;
+            int x, y;
+        };
+
+        std::vector<uchar> canvas, scaled;
+        std::vector<Blit> blits;
+        std::vector<Overlay> overlays;
+        // Canvas rectangle in native pixels of the level
+        int cx = 0, cy = 0, cw = 0, ch = 0;
+
+        static const uchar* pixels(const Fl_Image* img) { return static_cast<const Fl_RGB_Image*>(img)->array; }
+        static int line(const Fl_Image* img) { return img->ld() ? img->ld() : img->w() * img->d(); }
+
+        // Rows [y0, y1) of the canvas: background and the blits covering them
+        void compose(int y0, int y1) {
+            thread_local std::vector<uchar> resized;
+            uchar* rows = &canvas[static_cast<size_t>(y0) * cw * D];
+            for (size_t i = 0, n = static_cast<size_t>(y1 - y0) * cw * D; i < n; i += D) {
+                std::memcpy(rows + i, BACKGROUND, D);
+            }
+            y0 += cy, y1 += cy;
+            for (auto& b : blits) {
+                int d = b.img->d();
+                int x0 = std::max(b.x, cx), x1 = std::min(b.x + b.w, cx + cw);
+                int j0 = std::max(b.y, y0), j1 = std::min(b.y + b.h, y1);
+                if (d < 1 || x0 >= x1 || j0 >= j1) {
+                    continue;
+                }
+                int ld = line(b.img);
+                const uchar* src = pixels(b.img) + static_cast<size_t>(b.sy) * ld + b.sx * d;
+                // Pixel (x0, j0) of the blit, only the part covered being resampled when the sizes differ
+                const uchar* first = src + static_cast<size_t>(j0 - b.y) * ld + static_cast<size_t>(x0 - b.x) * d;
+                if (b.sw != b.w || b.sh != b.h) {
+                    double step_x = double(b.sw) / b.w, step_y = double(b.sh) / b.h;
+                    resized.resize(static_cast<size_t>(x1 - x0) * (j1 - j0) * d);
+                    resample::scale_region(src, b.sw, b.sh, ld, d, resized.data(), x1 - x0, j1 - j0,
+                        (x0 - b.x) * step_x, (j0 - b.y) * step_y, step_x, step_y);
+                    first = resized.data();
+                    ld = (x1 - x0) * d;
+                }
+                for (int j = j0; j < j1; j++) {
+                    const uchar* in = first + static_cast<size_t>(j - j0) * ld;
+                    uchar* out = &canvas[(static_cast<size_t>(j - cy) * cw + (x0 - cx)) * D];
+                    if (d == D) {
+                        std::memcpy(out, in, static_cast<size_t>(x1 - x0) * D);
+                        continue;
+                    }
+                    for (int i = x0; i < x1; i++, in += d, out += D) {
+                        // Grey images have one or two channels
+                        out[0] = in[0];
+                        out[1] = in[d < 3 ? 0 : 1];
+                        out[2] = in[d < 3 ? 0 : 2];
+                    }
+                }
+            }
+        }
+
+        // Blend the overlays into screen rows [y0, y1) of `out`, which shows the screen rectangle (X, Y, W, .)
+        void blend(uchar* out, int X, int Y, int W, int y0, int y1) const {
+            for (auto& o : overlays) {
+                int d = o.img->d();
+                int x0 = std::max(o.x, X), x1 = std::min(o.x + o.img->w(), X + W);
+                int j0 = std::max(o.y, Y + y0), j1 = std::min(o.y + o.img->h(), Y + y1);
+                if (d < 3 || x0 >= x1 || j0 >= j1) {
+                    continue;
+                }
+                int ld = line(o.img);
+                for (int j = j0; j < j1; j++) {
+                    const uchar* in = pixels(o.img) + static_cast<size_t>(j - o.y) * ld + static_cast<size_t>(x0 - o.x) * d;
+                    uchar* px = out + (static_cast<size_t>(j - Y) * W + (x0 - X)) * D;
+                    for (int i = x0; i < x1; i++, in += d, px += D) {
+                        int a = d == 4 ? in[3] : 255;
+                        if (a == 0) {
+                            continue;
+                        }
+                        for (int c = 0; c < D; c++) {
+                            px[c] = static_cast<uchar>((in[c] * a + px[c] * (255 - a) + 127) / 255);
+                        }
+                    }
+                }
+            }
+        }
+
+    public:
+        // Renders canvas and screen rows in bands when set, on the calling thread alone otherwise
+        raster::BandPool* pool = nullptr;
+
+        // Start a canvas covering the native pixels [x, x + w) x [y, y + h)
+        void begin(int x, int y, int w, int h) {
+            cx = x, cy = y, cw = std::max(w, 0), ch = std::max(h, 0);
+            canvas.resize(static_cast<size_t>(cw) * ch * D);
+            blits.clear();
+        }
+
+        // Copy a region of an image to the native rectangle (x, y, w, h), resampled when the sizes differ
+        // Images of any depth are converted to RGB, alpha is dropped as tilts are opaque
+        // Images are read when the canvas is drawn and have to stay alive until then
+        void blit(const Fl_Image* img, int sx, int sy, int sw, int sh, int x, int y, int w, int h) {
+            if (x < cx + cw && x + w > cx && y < cy + ch && y + h > cy) {
+                blits.push_back({ img, sx, sy, sw, sh, x, y, w, h });
+            }
+        }
+
+        // Blend an RGBA image over the screen at (x, y) once the canvas is drawn
+        void overlay(const Fl_Image* img, int x, int y) { overlays.push_back({ img, x, y }); }
+
+        // Draw the canvas to the screen rectangle (X, Y, W, H), whose top left corner shows native position (x, y),
+        // with `step` native pixels per screen pixel, followed by the overlays
+        void draw(double x, double y, double step, int X, int Y, int W, int H) {
+            x -= cx, y -= cy;
+            if (W <= 0 || H <= 0 || cw <= 0 || ch <= 0) {
+                overlays.clear();
+                return;
+            }
+            auto bands = [this](int rows, const std::function<void(int, int)>& fn) {
+                if (pool) {
+                    pool->run(rows, fn);
+                } else {
+                    fn(0, rows);
+                }
+            };
+            bands(ch, [this](int y0, int y1) { compose(y0, y1); });
+            bool aligned = step == 1 && x == std::floor(x) && y == std::floor(y) && x >= 0 && y >= 0 && x + W <= cw && y + H <= ch;
+            const uchar* row0 = aligned ? &canvas[(static_cast<size_t>(y) * cw + static_cast<size_t>(x)) * D] : nullptr;
+            // Unscaled and aligned, drawn straight from the canvas
+            if (aligned && overlays.empty()) {
+                fl_draw_image(row0, X, Y, W, H, D, cw * D);
+                return;
+            }
+            scaled.resize(static_cast<size_t>(W) * H * D);
+            bands(H, [&](int y0, int y1) {
+                uchar* out = &scaled[static_cast<size_t>(y0) * W * D];
+                if (aligned) {
+                    for (int j = y0; j < y1; j++) {
+                        std::memcpy(&scaled[static_cast<size_t>(j) * W * D], row0 + static_cast<size_t>(j) * cw * D,
+                            static_cast<size_t>(W) * D);
+                    }
+                } else {
+                    resample::scale_region(canvas.data(), cw, ch, cw * D, D, out, W, y1 - y0, x, y + y0 * step, step, step);
+                }
+                blend(scaled.data(), X, Y, W, y0, y1);
+            });
+            overlays.clear();
+            fl_draw_image(scaled.data(), X, Y, W, H, D);
+        }
+    };
+} // namespace map
@@ -116,17 +116,15 @@ namespace control{
         static void show_hide_cb(Fl_Widget* o, void* v) {
             auto c = (Fl_Area_Info*)v;
             c->t_area->flip_visible();
-            m->redraw_flag = true;
+            m->damage_area(*c->t_area);
             ((Fl_Button*)o)->label((c->t_area->visible() ? "Hide" : "Show"));
             o->redraw();
-            //win->redraw();
         }
         static void center_on_cb(Fl_Widget* o, void* v) {
             auto c = (Fl_Area_Info*)v;
             auto cen = c->t_area->center();
             m->focus_on(cen.x, cen.y);
-            m->redraw_flag = true;
-            //win->redraw();
+            m->redraw();
         }
     };
 
@@ -177,7 +175,7 @@ namespace control{
         }
 
         void link() { size_op->t_area = areas->temp; }
-        void update_size() { size_op->draw(); }
+        void update_size() { size_op->redraw(); }
         void update_name() {
             std::string str = area_name->value();
             if (str.empty()) {
@@ -189,7 +187,6 @@ namespace control{
             std::cout << str << std::endl;
 #endif // DEBUG
             areas->temp->set_name(str.c_str());
-            win->redraw();
             update_size();
         }
 
@@ -201,7 +198,8 @@ namespace control{
                 info->link(--(areas->areas.end()));
                 area_list->redraw();
             }
-            m->redraw_flag = 1;
+            // Every area changes its fill when the temporary one is gone
+            m->redraw();
             auto c = (Fl_New_Area_Control*)v;
             c->new_area->show();
             c->hide();
@@ -217,7 +215,7 @@ namespace control{
             c->area_name->value(str.c_str());
             areas->temp->set_name(str);
             c->size_op->t_area = areas->temp;
-            m->redraw_flag = true;
+            m->redraw();
             c->show();
             c->redraw();
             c->update_size();
@@ -226,15 +224,21 @@ namespace control{
         }
         static void undo_cb(Fl_Widget* o, void* v) {
             if (areas->temp) {
+                m->damage_area(*areas->temp, true);
                 areas->temp->undo_temp();
+                m->damage_area(*areas->temp, true);
             }
-            m->redraw_flag = true;
-            //win->redraw();
             ((Fl_New_Area_Control*)v)->update_size();
         }
         static void rename_cb(Fl_Widget* o, void* v) {
             auto c = (Fl_New_Area_Control*)v;
             c->update_name();
         }
+        // The temporary area changed on the map
+        static void map_cb(Fl_Widget* o, void* v) {
+            if (areas->temp) {
+                ((Fl_New_Area_Control*)v)->update_size();
+            }
+        }
     }*new_area_control;
 }
@@ -0,0 +1,58 @@
+#include "httplib.h"
+#include <cmath>
+#include <algorithm>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <map>
+#include <list>
+#include <deque>
+#include <set>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <numeric>
+#include <array>
+#include <bit>
+#include "tilts_cache.h"
+using namespace tilts;
+std::string tile(TiltId id, int n) { std::string s(n, 0); for (int i=0;i<n;i++) s[i]=char(id.x*31+id.y*7+i); return s; }
+int main(){
+  std::filesystem::remove_all("/tmp/t/dc");
+  int bad=0;
+  {
+    TiltsDiskCache c("/tmp/t/dc", TiltId{}.UDT, 2000000);
+    TiltMeta m; m.etag="e"; m.fetched=5;
+    for (int i=0;i<400;i++) {
+      TiltId id{.x=i,.y=i%7,.z=15};
+      c.put(id, tile(id, 10000+i), m);
+      // read back immediately from batch or pack
+      auto td=c.get(id); if (td.size!=size_t(10000+i) || std::memcmp(td.buf, tile(id,10000+i).data(), td.size)) bad++;
+      if (i%10==9) c.commit();
+      if (i%50==0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    c.commit(); std::this_thread::sleep_for(std::chrono::milliseconds(200)); c.commit();
+    int found=0;
+    for (int i=0;i<400;i++){ TiltId id{.x=i,.y=i%7,.z=15}; auto td=c.get(id); if(td.size){found++; if (td.size!=size_t(10000+i)||std::memcmp(td.buf, tile(id,10000+i).data(), td.size)) bad++;} }
+    std::cout<<"found "<<found<<" bytes "<<c.bytes()<<" file "<<std::filesystem::file_size("/tmp/t/dc/tilts.pack")<<"\n";
+  }
+  {
+    TiltsDiskCache c("/tmp/t/dc", TiltId{}.UDT, 2000000);
+    int found=0;
+    for (int i=0;i<400;i++){ TiltId id{.x=i,.y=i%7,.z=15}; auto td=c.get(id); if(td.size){found++; if (td.size!=size_t(10000+i)||std::memcmp(td.buf, tile(id,10000+i).data(), td.size)) bad++; auto mm=c.meta(id); if(!mm||mm->etag!="e") bad++;} }
+    std::cout<<"reopened found "<<found<<" bad "<<bad<<"\n";
+  }
+  return bad;
+}
@@ -0,0 +1,186 @@
+#pragma once
+//
+//  lru_cache.h
+//
+//  Least-recently-used cache on 64-bit keys
+//  Entries live in a node pool linked in recency order, located by an open-addressing hash table
+//  Each entry has a cost, e.g. its size in bytes, and eviction keeps the total within a budget
+//
+
+namespace cache {
+
+    template <typename V>
+    class LruCache {
+        static constexpr uint32_t NIL = ~0u;
+
+        struct Node {
+            uint64_t key;
+            V value;
+            size_t cost;
+            // Recency links, towards the most and the least recently used
+            uint32_t prev, next;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<uint32_t> free_nodes;
+        // Linear probing table of node indices, at most half full
+        std::vector<uint32_t> table;
+        uint32_t head = NIL, tail = NIL;
+        size_t count = 0, total = 0, budget;
+
+        static uint64_t hash(uint64_t k) {
+            // splitmix64 finaliser
+            k ^= k >> 30;
+            k *= 0xbf58476d1ce4e5b9ull;
+            k ^= k >> 27;
+            k *= 0x94d049bb133111ebull;
+            return k ^ (k >> 31);
+        }
+
+        size_t mask() const { return table.size() - 1; }
+
+        // Table slot holding the key, or the empty slot where it belongs
+        size_t probe(uint64_t key) const {
+            size_t i = hash(key) & mask();
+            while (table[i] != NIL && nodes[table[i]].key != key) {
+                i = (i + 1) & mask();
+            }
+            return i;
+        }
+
+        void unlink(uint32_t n) {
+            auto& node = nodes[n];
+            (node.prev == NIL ? head : nodes[node.prev].next) = node.next;
+            (node.next == NIL ? tail : nodes[node.next].prev) = node.prev;
+        }
+
+        void link_front(uint32_t n) {
+            nodes[n].prev = NIL;
+            nodes[n].next = head;
+            (head == NIL ? tail : nodes[head].prev) = n;
+            head = n;
+        }
+
+        void grow() {
+            std::vector<uint32_t> old(std::max<size_t>(table.size() * 2, 16), NIL);
+            old.swap(table);
+            for (auto n : old) {
+                if (n != NIL) {
+                    table[probe(nodes[n].key)] = n;
+                }
+            }
+        }
+
+        // Remove the entry at a table slot, shifting back the following probe chain
+        void remove_slot(size_t i) {
+            auto n = table[i];
+            unlink(n);
+            nodes[n].value = V();
+            free_nodes.push_back(n);
+            count--;
+            total -= nodes[n].cost;
+
+            size_t j = i;
+            while (true) {
+                j = (j + 1) & mask();
+                if (table[j] == NIL) {
+                    break;
+                }
+                size_t home = hash(nodes[table[j]].key) & mask();
+                // Move back entries whose home slot is not in (i, j]
+                if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+                    table[i] = table[j];
+                    i = j;
+                }
+            }
+            table[i] = NIL;
+        }
+
+        // Drop least recently used entries until within budget, keeping `keep`
+        void evict(uint32_t keep) {
+            while (total > budget && tail != NIL && tail != keep) {
+                remove_slot(probe(nodes[tail].key));
+            }
+        }
+
+    public:
+        LruCache(size_t budget) : budget(budget) { grow(); }
+
+        size_t size() const { return count; }
+        // Total cost of all entries
+        size_t cost() const { return total; }
+        size_t capacity() const { return budget; }
+
+        void set_capacity(size_t b) {
+            budget = b;
+            evict(NIL);
+        }
+
+        // Lookup without touching the recency order
+        V* peek(uint64_t key) {
+            auto n = table[probe(key)];
+            return n == NIL ? nullptr : &nodes[n].value;
+        }
+
+        // Lookup, making the entry the most recently used
+        V* find(uint64_t key) {
+            auto n = table[probe(key)];
+            if (n == NIL) {
+                return nullptr;
+            }
+            if (n != head) {
+                unlink(n);
+                link_front(n);
+            }
+            return &nodes[n].value;
+        }
+
+        // Insert or replace an entry as the most recently used, evicting the least recently used ones
+        V& put(uint64_t key, V value, size_t cost = 1) {
+            if (auto v = find(key)) {
+                *v = std::move(value);
+                total += cost - nodes[head].cost;
+                nodes[head].cost = cost;
+                evict(head);
+                return *v;
+            }
+            if ((count + 1) * 2 > table.size()) {
+                grow();
+            }
+            uint32_t n;
+            if (free_nodes.empty()) {
+                n = static_cast<uint32_t>(nodes.size());
+                nodes.push_back({ key, std::move(value), cost, NIL, NIL });
+            } else {
+                n = free_nodes.back();
+                free_nodes.pop_back();
+                nodes[n].key = key;
+                nodes[n].value = std::move(value);
+                nodes[n].cost = cost;
+            }
+            table[probe(key)] = n;
+            link_front(n);
+            count++;
+            total += cost;
+            evict(n);
+            return nodes[n].value;
+        }
+
+        bool erase(uint64_t key) {
+            auto i = probe(key);
+            if (table[i] == NIL) {
+                return false;
+            }
+            remove_slot(i);
+            return true;
+        }
+
+        void clear() {
+            nodes.clear();
+            free_nodes.clear();
+            std::fill(table.begin(), table.end(), NIL);
+            head = tail = NIL;
+            count = total = 0;
+        }
+    };
+} // namespace cache
@@ -3,54 +3,337 @@
 //  map_display.h
 // 
 //  Higher level control of the map
-//  Use offscreen offscreen graphics buffer to refresh the screen
+//  Tilts are kept in an offscreen base layer, areas are drawn over it on every frame,
+//  or whole frames are rendered on the CPU in bands by a thread pool, see RASTER_KEY
 //  Map tilts are saved and managed with a double-layered cache
 //
 
 #include "map_process.h"
+#include "tilts_source.h"
+#include "tilts_decoder.h"
+#include "compositor.h"
 #include "area_display.h"
 
 namespace map {
 
+    // Prefetching: tilts requested per frame, and drag events to look ahead for
+    const int PREFETCH_TILTS = 24;
+    const double PREFETCH_EVENTS = 15;
+    // Levels to look up for a cached ancestor of a missing tilt
+    const int FALLBACK_LEVELS = 4;
+    // Default memory budget of decoded tilt images
+    const size_t IMAGE_CACHE_SIZE = 192ull << 20;
+    // Keys toggling the metrics overlay and appending a metrics snapshot to METRICS_PATH
+    const int METRICS_OVERLAY_KEY = FL_F + 3, METRICS_DUMP_KEY = FL_F + 4;
+    // Switches between the base layer and frames rendered on the CPU by a band pool
+    const int RASTER_KEY = FL_F + 5;
+    const char* const METRICS_PATH = "metrics.txt";
+
+    // Bytes used by each cache tier
+    struct CacheUsage {
+        size_t tilts, images;
+        uint64_t disk;
+    };
+
+    // Union of damaged screen rectangles
+    struct DirtyRect {
+        int x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+
+        bool empty() const { return x1 >= x2 || y1 >= y2; }
+        void clear() { x1 = x2 = 0; }
+        void add(int a1, int b1, int a2, int b2) {
+            if (empty()) {
+                x1 = a1, y1 = b1, x2 = a2, y2 = b2;
+            } else {
+                x1 = std::min(x1, a1), y1 = std::min(y1, b1);
+                x2 = std::max(x2, a2), y2 = std::max(y2, b2);
+            }
+        }
+        void add(const DirtyRect& r) {
+            if (!r.empty()) {
+                add(r.x1, r.y1, r.x2, r.y2);
+            }
+        }
+    };
+
+    // Decoded size of an image
+    inline size_t image_bytes(const Fl_Image* img) {
+        return static_cast<size_t>(img->w()) * img->h() * img->d();
+    }
+
     class Fl_Map : public Map, public Fl_Group {
         // Number of colums and rows of tilt images
         int cols, rows;
-        // Images buffer for posision-only changes
-        std::map<tilts::TiltId, Fl_Image*> redraw_buffer;
-        std::list<tilts::TiltId> redraw_list;
-        size_t max_cache_size;
-        // Source of tilts and another buffer
-        tilts::TiltsSource src;
-
-        Fl_Offscreen oscr;
+        // Tilts decoded at native size, of the current level or standing in for missing tilts of other levels
+        cache::LruCache<std::unique_ptr<Fl_Image>> native_buffer;
+        // Scales the tilts of each frame to the zoom factor at once
+        Compositor compositor;
+        // Chain of tilt providers and another buffer
+        std::unique_ptr<tilts::TiltProvider> src;
+        // Decodes tilts off the UI thread
+        tilts::TiltDecoder decoder;
+
+        // Base layer of tilts, and whether it must be redrawn entirely
+        // Panning copies it shifted into `back` and swaps the two, as an offscreen cannot be copied onto itself
+        Fl_Offscreen base, back;
+        bool base_stale = true;
+        // Visible tilts not drawn from their own image in the last frame
+        int missing = 0;
+        // Regions damaged since the last frame, by landed tilts and by changes drawn over the base layer only
+        DirtyRect dirty, exposed;
+        // Map origin of the base layer contents, see grid_origin(), and the same before rounding
+        int64_t drawn_x = 0, drawn_y = 0;
+        double drawn_fx = 0, drawn_fy = 0;
+        // Threads rendering whole frames in bands, the base layer is used when null
+        std::unique_ptr<raster::BandPool> pool;
+        // Metrics overlay in the top left corner, and its last drawn size
+        bool show_metrics = false;
+        int overlay_w = 0, overlay_h = 0;
+        metrics::Counter& image_hits = metrics::registry().counter("images.hits");
+        metrics::Counter& image_misses = metrics::registry().counter("images.misses");
+        metrics::Histogram& frame_time = metrics::registry().histogram("map.frame_us");
         int mouse_x = 0, mouse_y = 0;
         bool dragging = false;
+        // Smoothed drag velocity in pixels per event, and last zooming direction
+        double vx = 0, vy = 0;
+        int zoom_dir = 0;
+
+        // Tilts to prefetch ahead of the motion along one axis, signed in tilt index direction
+        int lookahead(double v, int pixels_per_tilt) const {
+            if (std::abs(v) < 2) {
+                return 0;
+            }
+            int n = std::clamp(static_cast<int>(std::ceil(std::abs(v) * PREFETCH_EVENTS / pixels_per_tilt)), 1, 3);
+            // Dragging the map right brings tilts on the left into view
+            return v > 0 ? -n : n;
+        }
+
+        // Native image of a tilt, requested for decoding when missing
+        // Only tilts already loaded are decoded unless `load` is set
+        Fl_Image* native(tilts::TiltId id, bool load = false) {
+            if (auto img = native_buffer.find(id.key())) {
+                return img->get();
+            }
+            if (!decoder.isDecoding(id)) {
+                decoder.request(id, load ? src->get(id) : src->peek(id));
+            }
+            return nullptr;
+        }
+
+        // Stand in for a missing tilt at native position (x, y) with its nearest ancestor or its descendants
+        void draw_fallback(tilts::TiltId ti, int x, int y) {
+            const int size = tilts::TILT_SIZE, half = size / 2;
+            // Cropped and upscaled ancestor
+            for (int l = 1; l <= FALLBACK_LEVELS && ti.z - l >= MIN_LEVEL; l++) {
+                if (auto img = native(ti.parent(l))) {
+                    int part = size >> l;
+                    int sx = (ti.x & ((1 << l) - 1)) * part, sy = (ti.y & ((1 << l) - 1)) * part;
+                    compositor.blit(img, sx, sy, part, part, x, y, size, size);
+                    return;
+                }
+            }
+            // Downscaled children
+            if (ti.z >= MAX_LEVEL) {
+                return;
+            }
+            Fl_Image* children[4];
+            for (int c = 0; c < 4; c++) {
+                if (!(children[c] = native(ti.child(c)))) {
+                    return;
+                }
+            }
+            for (int c = 0; c < 4; c++) {
+                compositor.blit(children[c], 0, 0, size, size, x + c % 2 * half, y + c / 2 * half, half, half);
+            }
+        }
+
+        // Screen position of the map's corner to the nearest pixel, moving with the tilts as the map pans
+        std::pair<int64_t, int64_t> grid_origin() const {
+            return { -std::llround(lng * pixels_per_side), -std::llround(lat * pixels_per_side) };
+        }
+
+        // Whether the map moved by whole pixels since the base layer was drawn, so that scrolling it lines up
+        // Panning keeps to whole pixels, centring on a point (focus_on) generally does not
+        bool whole_pixel_move() const {
+            double fx = -lng * pixels_per_side - drawn_fx, fy = -lat * pixels_per_side - drawn_fy;
+            return std::abs(fx - std::round(fx)) < 1e-3 && std::abs(fy - std::round(fy)) < 1e-3;
+        }
+
+        // Mark a region of the map for redrawing, with `bit` telling whether the base layer changed there
+        void damage_rect(DirtyRect& r, uchar bit, int x1, int y1, int x2, int y2) {
+            x1 = std::max(x1, 0), y1 = std::max(y1, 0);
+            x2 = std::min(x2, static_cast<int>(Map::w)), y2 = std::min(y2, static_cast<int>(Map::h));
+            if (x1 >= x2 || y1 >= y2) {
+                return;
+            }
+            r.add(x1, y1, x2, y2);
+            damage(bit, x() + x1, y() + y1, x2 - x1, y2 - y1);
+        }
+        void damage_rect(int x1, int y1, int x2, int y2) { damage_rect(dirty, FL_DAMAGE_USER1, x1, y1, x2, y2); }
+
+        // Mark the on-screen area of a tilt of any level for redrawing
+        void damage_tilt(tilts::TiltId id) {
+            double pixels_per_tilt = k * tilts::TILT_SIZE;
+            double n = static_cast<double>(tilts_per_side), scale = n / (1 << id.z);
+            // Tilt position in tilts of the current level, wrapped next to the screen
+            double tx = id.x * scale - lng * n, ty = id.y * scale - lat * n;
+            tx -= std::floor((tx + scale) / n) * n;
+            // Filtering blends a pixel of the neighbouring tilts in
+            damage_rect(static_cast<int>(std::floor(tx * pixels_per_tilt)) - 2, static_cast<int>(std::floor(ty * pixels_per_tilt)) - 2,
+                static_cast<int>(std::ceil((tx + scale) * pixels_per_tilt)) + 2, static_cast<int>(std::ceil((ty + scale) * pixels_per_tilt)) + 2);
+        }
+
+        // Nothing to do, waking up the event loop is enough
+        static void wake(void*) {}
+
+        // Redraw the metrics overlay every second while it is shown
+        static void refresh_overlay(void* m) {
+            auto map = static_cast<Fl_Map*>(m);
+            map->damage_overlay(0, 0, map->overlay_w, map->overlay_h);
+            Fl::repeat_timeout(1.0, refresh_overlay, m);
+        }
+
+        void draw_overlay() {
+            auto usage = cache_usage();
+            auto& r = metrics::registry();
+            r.gauge("cache.tilts_bytes").set(usage.tilts);
+            r.gauge("cache.images_bytes").set(usage.images);
+            r.gauge("cache.disk_bytes").set(usage.disk);
+            if (!show_metrics) {
+                return;
+            }
+            auto lines = r.lines();
+            fl_font(FL_COURIER, 12);
+            int lh = fl_height();
+            overlay_w = 0;
+            for (auto& l : lines) {
+                overlay_w = std::max(overlay_w, static_cast<int>(fl_width(l.c_str())));
+            }
+            overlay_w += 16;
+            overlay_h = static_cast<int>(lines.size()) * lh + 16;
+            fl_rectf(8, 8, overlay_w, overlay_h - 8, fl_rgb_color(40, 40, 40));
+            fl_color(FL_WHITE);
+            for (size_t i = 0; i < lines.size(); i++) {
+                fl_draw(lines[i].c_str(), 16, 12 + static_cast<int>(i + 1) * lh - fl_descent());
+            }
+            overlay_w += 8;
+        }
+
+        // Request tilts around the screen and on neighbouring levels
+        void prefetch(tilts::TiltId tilt0, int ax, int ay) {
+            int budget = PREFETCH_TILTS;
+            auto request = [&](tilts::TiltId id) {
+                int n = 1 << id.z;
+                id.x = (id.x % n + n) % n;
+                if (budget > 0 && id.y >= 0 && id.y < n && src->prefetch(id)) {
+                    budget--;
+                }
+            };
+            // Ring ahead of the motion
+            for (int i = std::min(ax, 0); i < rows + std::max(ax, 0); i++) {
+                for (int j = std::min(ay, 0); j < cols + std::max(ay, 0); j++) {
+                    if (i < 0 || i >= rows || j < 0 || j >= cols) {
+                        request(tilt0.offset(i, j));
+                    }
+                }
+            }
+            // Parent and child levels, the one being zoomed to first
+            auto parents = [&] {
+                for (int i = 0; static_cast<int>(z) > MIN_LEVEL && i < rows; i++) {
+                    for (int j = 0; j < cols; j++) {
+                        auto ti = tilt0.offset(i, j);
+                        request(tilts::TiltId{ .x = ti.x >> 1, .y = ti.y >> 1, .z = ti.z - 1 });
+                    }
+                }
+            };
+            auto children = [&] {
+                for (int i = 0; static_cast<int>(z) < MAX_LEVEL && i < rows; i++) {
+                    for (int j = 0; j < cols; j++) {
+                        auto ti = tilt0.offset(i, j);
+                        for (int c = 0; c < 4; c++) {
+                            request(tilts::TiltId{ .x = ti.x * 2 + c % 2, .y = ti.y * 2 + c / 2, .z = ti.z + 1 });
+                        }
+                    }
+                }
+            };
+            if (zoom_dir > 0) {
+                children();
+                parents();
+            } else {
+                parents();
+                children();
+            }
+        }
 
     public:
         area::Fl_Area* areas;
-        bool redraw_flag = 0, resize_flag = 0;
+        bool resize_flag = 0;
 
-        // Offscreen drawing function for displaying map and areas
-        void draw_map(bool resize = true) {
-            redraw_flag = false;
-            resize_flag = false;
+        // Mark a region for redrawing over the base layer, for changes of areas and overlays
+        void damage_overlay(int x1, int y1, int x2, int y2) { damage_rect(exposed, FL_DAMAGE_USER2, x1, y1, x2, y2); }
+
+        // Mark the on-screen bounds of an area for redrawing, the whole map when it is off screen behind an indicator
+        void damage_area(const area::Area& a, bool has_temp = false) {
+            auto [b1, b2] = a.bounds(has_temp);
+            // Outlines are 3 pixels wide and scaled fills blur a little beyond them
+            const int margin = 6;
+            int x1 = static_cast<int>(std::floor((b1.x - lng) * pixels_per_side)) - margin;
+            int y1 = static_cast<int>(std::floor((b1.y - lat) * pixels_per_side)) - margin;
+            int x2 = static_cast<int>(std::ceil((b2.x - lng) * pixels_per_side)) + margin;
+            int y2 = static_cast<int>(std::ceil((b2.y - lat) * pixels_per_side)) + margin;
+            if (x2 <= 0 || y2 <= 0 || x1 >= static_cast<int>(Map::w) || y1 >= static_cast<int>(Map::h)) {
+                x1 = y1 = 0, x2 = static_cast<int>(Map::w), y2 = static_cast<int>(Map::h);
+            }
+            damage_overlay(x1, y1, x2, y2);
+        }
+
+        // Base layer of tilts only, kept in its own offscreen and redrawn when the map pans, zooms or tilts land
+        // Tilts outside the clip region are skipped, `partial` redraws leave loading untouched
+        void draw_base(bool partial = false) {
+            std::tie(drawn_x, drawn_y) = grid_origin();
+            drawn_fx = -lng * pixels_per_side, drawn_fy = -lat * pixels_per_side;
 #if NO_MAP
-            fl_rectf(0, 0, Map::w, Map::h, fl_rgb_color(252, 249, 242));
-            areas->sync_with(*this);
-            areas->draw_areas(resize);
+            int cx, cy, cw, ch;
+            fl_clip_box(0, 0, static_cast<int>(Map::w), static_cast<int>(Map::h), cx, cy, cw, ch);
+            compositor.begin(cx, cy, cw, ch);
+            compositor.draw(cx, cy, 1, cx, cy, cw, ch);
             return;
 #endif // NO_MAP
 
             // Index for top left tilt
             auto tilt0 = mercator_to_tilt_id(lng, lat, z);
 
-            // Screen coordinate for top left corner of top left tilt
+            // Native position of the screen's top left corner, from the corner of the top left tilt
+            const int size = tilts::TILT_SIZE;
             double xz = lng * tilts_per_side, yz = lat * tilts_per_side;
-            int pixels_per_tilt = static_cast<int>(tilts::TILT_SIZE * k);
-            int x0 = static_cast<int>((int(xz) - xz) * pixels_per_tilt);
-            int y0 = static_cast<int>((int(yz) - yz) * pixels_per_tilt);
+            double nx = (xz - int(xz)) * size, ny = (yz - int(yz)) * size;
+            // Unscaled tilts are kept on whole pixels
+            if (k == 1) {
+                nx = std::round(nx), ny = std::round(ny);
+            }
+            int pixels_per_tilt = tilt_pixels();
+
+            // Downloading visible tilts first, keeping one extra tilt around the screen plus the prefetched ones
+            int ax = lookahead(vx, pixels_per_tilt), ay = lookahead(vy, pixels_per_tilt);
+            double hw = Map::w / 2.0 / pixels_per_tilt, hh = Map::h / 2.0 / pixels_per_tilt;
+            if (!partial) {
+                src->setViewport({ .z = static_cast<int>(z), .cx = xz + hw, .cy = yz + hh,
+                    .hw = hw + 1 + std::abs(ax), .hh = hh + 1 + std::abs(ay) });
+            }
+
+            // Region of the screen to draw, and the native pixels it covers with a margin for filtering
+            int X, Y, W, H;
+            fl_clip_box(0, 0, static_cast<int>(Map::w), static_cast<int>(Map::h), X, Y, W, H);
+            double step = 1 / k;
+            int nx0 = static_cast<int>(std::floor(nx + X * step)) - 1, ny0 = static_cast<int>(std::floor(ny + Y * step)) - 1;
+            int nx1 = static_cast<int>(std::ceil(nx + (X + W) * step)) + 1, ny1 = static_cast<int>(std::ceil(ny + (Y + H) * step)) + 1;
+            compositor.begin(nx0, ny0, nx1 - nx0, ny1 - ny0);
+            // Native pixels of the whole screen, tilts beyond them are not missed when absent
+            int vx0 = static_cast<int>(std::floor(nx)), vy0 = static_cast<int>(std::floor(ny));
+            int vx1 = static_cast<int>(std::ceil(nx + Map::w * step)), vy1 = static_cast<int>(std::ceil(ny + Map::h * step));
 
-            // Displaying tilts
+            // Composing native tilts
+            missing = 0;
             for (int i = 0; i < rows; i++) {
                 for (int j = 0; j < cols; j++) {
                     // Index for tilt[i, j]
@@ -61,85 +344,149 @@ namespace map {
                     } else if (ti.x < 0) {
                         ti.x += static_cast<int>(tilts_per_side);
                     }
-                    // Resized tilt image
-                    Fl_Image* pngResized;
-                    if (redraw_buffer.find(ti) != redraw_buffer.end()) {
-                        // Cache hit
-                        pngResized = redraw_buffer[ti];
-                    } else {
-                        // Get tilt from source
-                        auto td = src.get(ti);
-                        if (td.size == 0) {
-                            // Not successfully requested yet
-                            fl_rectf(x0 + i * pixels_per_tilt, y0 + j * pixels_per_tilt,
-                                pixels_per_tilt, pixels_per_tilt, fl_rgb_color(252, 249, 242));
-                            continue;
+                    int tx = i * size, ty = j * size;
+                    if (tx >= vx1 || tx + size <= vx0 || ty >= vy1 || ty + size <= vy0) {
+                        continue;
+                    }
+                    // On screen but outside the clip
+                    if (W <= 0 || H <= 0 || tx >= nx1 || tx + size <= nx0 || ty >= ny1 || ty + size <= ny0) {
+                        if (!native_buffer.peek(ti.key())) {
+                            missing++;
                         }
-                        auto png = Fl_PNG_Image(nullptr, td.buf, td.size);
-                        pngResized = png.copy(pixels_per_tilt, pixels_per_tilt);
-                        // Storing resized image into buffer
-                        redraw_list.push_back(ti);
-                        redraw_buffer[ti] = pngResized;
+                        continue;
                     }
-                    pngResized->draw(x0 + i * pixels_per_tilt, y0 + j * pixels_per_tilt);
-                    /*if (DEBUG) {
-                        std::cout << "Putting tilt " << ti << " at ("
-                            << x0 + i * pixels_per_tilt << ", "
-                            << y0 + j * pixels_per_tilt << ")" << std::endl;
-                    }*/
+                    // Native tilt image, the tilt is loaded and decoded when missing
+                    if (auto img = native(ti, true)) {
+                        image_hits.add();
+                        compositor.blit(img, 0, 0, size, size, tx, ty, size, size);
+                        continue;
+                    }
+                    image_misses.add();
+                    // Not decoded yet
+                    missing++;
+                    draw_fallback(ti, tx, ty);
                 }
             }
-            // Synchronising coordinate and zoom factors
-            areas->sync_with(*this);
-            areas->draw_areas(resize);
-        }
-
-        void draw_normal() {
-            // Clear up buffer if exceeds the limit
-            while (redraw_list.size() > max_cache_size) {
-                delete redraw_buffer[redraw_list.front()];
-                redraw_buffer.erase(redraw_list.front());
-                redraw_list.pop_front();
+            compositor.draw(nx + X * step, ny + Y * step, step, X, Y, W, H);
+            if (!partial) {
+                prefetch(tilt0, ax, ay);
             }
+        }
 
-            fl_begin_offscreen(oscr);
-            draw_map(false);
-            fl_end_offscreen();
-            fl_copy_offscreen(0, 0, Map::w, Map::h, oscr, 0, 0);
+        // Draw the base layer into part of its offscreen, everything in it is painted over
+        void draw_base_clipped(int x, int y, int w, int h, bool partial) {
+            fl_push_clip(x, y, w, h);
+            draw_base(partial);
+            fl_pop_clip();
         }
 
-        void draw_resize(bool disable_offscreen = false) {
-            // Recreate buffer
-            for (auto& p : redraw_buffer) {
-                delete p.second;
+        // Bring the base layer up to date: scroll it by the distance panned and draw only the exposed strips,
+        // then the region of landed tilts
+        // Returns whether it changed beyond the dirty region
+        bool update_base() {
+            auto [gx, gy] = grid_origin();
+            int dx = static_cast<int>(gx - drawn_x), dy = static_cast<int>(gy - drawn_y);
+            int w = static_cast<int>(Map::w), h = static_cast<int>(Map::h);
+            bool moved = dx || dy;
+            if (base_stale || !whole_pixel_move() || std::abs(dx) >= w || std::abs(dy) >= h) {
+                fl_begin_offscreen(base);
+                draw_base();
+                fl_end_offscreen();
+                base_stale = false;
+                return true;
             }
-            redraw_buffer.clear();
-            redraw_list.clear();
-#if DEBUG
-            std::cout << "Resized! Cache Cleared." << std::endl;
-#endif // DEBUG
-
-            if (disable_offscreen) {
-                draw_map();
-                return;
+            if (moved) {
+                // The part still visible moves into the other buffer, which becomes the base layer
+                fl_begin_offscreen(back);
+                fl_copy_offscreen(std::max(dx, 0), std::max(dy, 0), w - std::abs(dx), h - std::abs(dy), base,
+                    std::max(-dx, 0), std::max(-dy, 0));
+                std::swap(base, back);
+                if (dx) {
+                    draw_base_clipped(dx > 0 ? 0 : w + dx, 0, std::abs(dx), h, false);
+                }
+                if (dy) {
+                    draw_base_clipped(0, dy > 0 ? 0 : h + dy, w, std::abs(dy), dx != 0);
+                }
+            } else {
+                fl_begin_offscreen(base);
+            }
+            if (!dirty.empty()) {
+                draw_base_clipped(dirty.x1, dirty.y1, dirty.x2 - dirty.x1, dirty.y2 - dirty.y1, moved);
             }
-            fl_begin_offscreen(oscr);
-            draw_map();
             fl_end_offscreen();
-            fl_copy_offscreen(0, 0, Map::w, Map::h, oscr, 0, 0);
+            return moved;
         }
 
+        // Tilts and area fills rendered into one framebuffer by the band pool, with outlines stroked over it
+        void draw_frame(bool resize, bool partial) {
+            areas->draw_areas(resize, area::Fl_Area::FILL, [this](const Fl_Image* img, int x, int y) {
+                compositor.overlay(img, x, y);
+            });
+            draw_base(partial);
+            areas->draw_areas(resize, area::Fl_Area::OUTLINE);
+        }
+
+        // Base layer with the areas composed on top, only the dirty region unless the whole map changed
         void draw() override {
-            if (resize_flag) {
-                draw_resize();
+            metrics::ScopedTimer timer(frame_time);
+            bool resize = resize_flag;
+            if (resize) {
+                base_stale = true;
+#if DEBUG
+                auto usage = cache_usage();
+                std::cout << "Resized! Using " << usage.tilts / 1024 << " KiB of tilts, "
+                    << usage.images / 1024 << " KiB of images, "
+                    << usage.disk / 1024 << " KiB on disk" << std::endl;
+#endif // DEBUG
+            }
+            bool full;
+            if (pool) {
+                // Rendered from scratch, leaving the base layer to be redrawn when switching back
+                full = grid_origin() != std::pair(drawn_x, drawn_y) || !whole_pixel_move() || resize
+                    || (damage() & ~(FL_DAMAGE_SCROLL | FL_DAMAGE_USER1 | FL_DAMAGE_USER2));
+                base_stale = true;
             } else {
-                draw_normal();
+                full = update_base() || resize || (damage() & ~(FL_DAMAGE_SCROLL | FL_DAMAGE_USER1 | FL_DAMAGE_USER2));
             }
+            resize_flag = false;
+            int x = 0, y = 0, w = static_cast<int>(Map::w), h = static_cast<int>(Map::h);
+            if (!full) {
+                DirtyRect r = dirty;
+                r.add(exposed);
+                x = r.x1, y = r.y1, w = r.x2 - r.x1, h = r.y2 - r.y1;
+            }
+            if (w > 0 && h > 0) {
+                fl_push_clip(x, y, w, h);
+                areas->sync_with(*this);
+                if (pool) {
+                    draw_frame(resize, !full);
+                } else {
+                    fl_copy_offscreen(x, y, w, h, base, x, y);
+                    // Areas are drawn over the base layer on every frame, so editing them leaves the tilts alone
+                    areas->draw_areas(resize);
+                }
+                fl_pop_clip();
+            }
+            dirty.clear();
+            exposed.clear();
+            draw_overlay();
         }
 
+        // Pan the map, scrolling what is already drawn on the next frame
         void drag_screen_by(int dx, int dy) {
+            auto [x1, y1] = grid_origin();
             translate(dx, dy);
-            redraw_flag = true;
+            auto [x2, y2] = grid_origin();
+            vx = vx * 0.5 + dx * 0.5;
+            vy = vy * 0.5 + dy * 0.5;
+            // Landed tilts move along
+            if (!dirty.empty()) {
+                auto r = dirty;
+                int sx = static_cast<int>(x2 - x1), sy = static_cast<int>(y2 - y1);
+                dirty.clear();
+                damage_rect(r.x1 + sx, r.y1 + sy, r.x2 + sx, r.y2 + sy);
+            }
+            damage(FL_DAMAGE_SCROLL);
 #if DEBUG
             std::cout << "Dragged by dx = " << dx << ", dy = " << dy
                 << ", now lng = " << lng << ", lat = " << lat << std::endl;
@@ -162,8 +509,9 @@ namespace map {
                     << std::endl;
 #endif // DEBUG
                 //draw_resize(z1 != z);
-                redraw_flag = true;
+                zoom_dir = dy < 0 ? 1 : -1;
                 resize_flag = true;
+                redraw();
             }
         }
 
@@ -175,15 +523,19 @@ namespace map {
             case FL_MOVE: {
                 if (areas->temp) {
                     auto [x, y] = cursor_mercator(Fl::event_x(), Fl::event_y());
+                    damage_area(*areas->temp, true);
                     areas->temp->set_temp(x, y);
-                    redraw_flag = true;
+                    damage_area(*areas->temp, true);
+                    do_callback();
                 }
                 return 1;
             }
             case FL_LEAVE: {
                 if (areas->temp) {
+                    damage_area(*areas->temp, true);
                     areas->temp->reset_temp();
-                    redraw_flag = true;
+                    damage_area(*areas->temp, true);
+                    do_callback();
                 }
                 return 1;
             }
@@ -211,37 +563,147 @@ namespace map {
             case FL_RELEASE: {
                 if (Fl::event_is_click() && areas->temp && areas->temp->legal()) {
                     areas->temp->confirm_temp();
+                    damage_area(*areas->temp, true);
+                    do_callback();
                 }
                 dragging = false;
+                vx = vy = 0;
                 return 1;
             }
             case FL_MOUSEWHEEL:
                 scroll_by(Fl::event_dy(), Fl::event_x(), Fl::event_y());
+                break;
+            case FL_SHORTCUT: {
+                if (Fl::event_key() == METRICS_OVERLAY_KEY) {
+                    show_metrics = !show_metrics;
+                    if (show_metrics) {
+                        Fl::add_timeout(1.0, refresh_overlay, this);
+                    } else {
+                        Fl::remove_timeout(refresh_overlay, this);
+                    }
+                    damage_overlay(0, 0, overlay_w, overlay_h);
+                    return 1;
+                }
+                if (Fl::event_key() == RASTER_KEY) {
+                    set_raster_threads(pool ? 0 : raster::default_threads());
+#if DEBUG
+                    std::cout << "Rendering " << (pool ? "frames in bands on " + std::to_string(pool->size()) + " threads"
+                        : std::string("over the base layer")) << std::endl;
+#endif // DEBUG
+                    return 1;
+                }
+                if (Fl::event_key() == METRICS_DUMP_KEY) {
+                    bool ok = metrics::registry().dump(METRICS_PATH);
+                    std::cout << (ok ? "Metrics written to " : "Failed to write metrics to ") << METRICS_PATH << std::endl;
+                    return 1;
+                }
+                break;
+            }
             }
             return Fl_Widget::handle(event);
         }
 
-        Fl_Map(int u, int v, size_t w, size_t h)
+        // Tilts are loaded from `source`, the default chain down to the tile server when null
+        Fl_Map(int u, int v, size_t w, size_t h, std::unique_ptr<tilts::TiltProvider> source = nullptr)
             : Fl_Group(u, v, w, h), Map(w, h, 1, 15), rows(int(w / tilts::TILT_SIZE) + 2),
-            cols(int(h / tilts::TILT_SIZE) + 2), src(cols* rows * 30),
-            max_cache_size(cols* rows * 5) {
+            cols(int(h / tilts::TILT_SIZE) + 2), native_buffer(IMAGE_CACHE_SIZE),
+            src(source ? std::move(source) : tilts::default_source()) {
 #if DEBUG
             std::cout << "Initializing map with rows = " << rows
                 << ", cols = " << cols << std::endl;
 #endif // DEBUG
 
             areas = new area::Fl_Area(0, 0, w, h);
-            oscr = fl_create_offscreen(w, h);
+            base = fl_create_offscreen(w, h);
+            back = fl_create_offscreen(w, h);
+
+            // Workers wake up the event loop with the map as token, see poll_futures()
+            auto wakeup = [this] { Fl::awake(this); };
+            src->setWakeup(wakeup);
+            decoder.setWakeup(wakeup);
         }
 
         ~Fl_Map() {
-            for (auto& p : redraw_buffer) {
-                delete p.second;
-            }
-            fl_delete_offscreen(oscr);
+            src->shutdown();
+            decoder.shutdown();
+            Fl::remove_timeout(wake, this);
+            Fl::remove_timeout(refresh_overlay, this);
+            fl_delete_offscreen(base);
+            fl_delete_offscreen(back);
             delete areas;
         }
 
-        std::tuple<bool, bool> poll_futures() { return src.pollFutures(); }
+        // Number of visible tilts still waiting for their image, as of the last frame
+        int missing_tilts() const { return missing; }
+
+        // Byte budgets of compressed tilts and decoded images
+        void set_cache_budgets(size_t tilts_budget, size_t images_budget) {
+            src->setMemoryBudget(tilts_budget);
+            native_buffer.set_capacity(images_budget);
+        }
+
+        CacheUsage cache_usage() const {
+            return { src->memoryBytes(), native_buffer.cost(), src->diskBytes() };
+        }
+
+        // Redraw everything on the next frame, the base layer included
+        void invalidate() {
+            base_stale = true;
+            redraw();
+        }
+
+        // Render frames in bands on `threads` threads, or over the base layer when 0
+        void set_raster_threads(int threads) {
+            pool = threads > 0 ? std::make_unique<raster::BandPool>(threads) : nullptr;
+            compositor.pool = pool.get();
+            base_stale = true;
+            redraw();
+        }
+
+        // On-screen size of a tilt
+        int tilt_pixels() const { return static_cast<int>(tilts::TILT_SIZE * k); }
+
+        // Collect downloaded and decoded tilts, damaging the parts of the screen they land on
+        // Called whenever the event loop wakes up, by user events or by workers through Fl::awake
+        // Returns whether any work is still pending and how many tilts arrived
+        std::tuple<bool, size_t> poll_futures() {
+            size_t delivered = 0;
+            auto [downloading, arrived] = src->poll([&](tilts::TiltId id, const tilts::TiltBuffer& data, const tilts::TiltMeta&) {
+                // Unchanged after revalidation
+                if (!data) {
+                    return;
+                }
+                // Image decoded from an outdated version
+                native_buffer.erase(id.key());
+                // Visible tilts to decode, and tilts of other levels while they may stand in for missing ones
+                if (id.z == static_cast<int>(z) || missing) {
+                    damage_tilt(id);
+                }
+                delivered++;
+            });
+            // Failed tilts due for retrying are only found by a full redraw
+            if (arrived > delivered) {
+                base_stale = true;
+                redraw();
+            }
+            Fl::remove_timeout(wake, this);
+            if (auto delay = src->nextRetry()) {
+                Fl::add_timeout(*delay, wake, this);
+            }
+
+            arrived += decoder.poll([&](tilts::DecodedTilt& t) {
+                if (native_buffer.peek(t.id.key())) {
+                    return false;
+                }
+                // Scaled while compositing, so zooming does not decode again
+                native_buffer.put(t.id.key(), std::unique_ptr<Fl_Image>(t.image), image_bytes(t.image));
+                // Tilts of other levels only matter while they may stand in for missing ones
+                if (t.id.z == static_cast<int>(z) || missing) {
+                    damage_tilt(t.id);
+                }
+                return true;
+            });
+            return { downloading || decoder.busy(), arrived };
+        }
     };
 } // namespace map
\ No newline at end of file
@@ -15,31 +15,92 @@
 #include <algorithm>
 #include <tuple>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <optional>
 #include <variant>
 #include <random>
 #include <string>
 #include <map>
 #include <list>
+#include <deque>
+#include <set>
+#include <vector>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <functional>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <numeric>
+#include <array>
+#include <bit>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#endif
+#if defined(_WIN32)
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 #define DEBUG true
 #define NO_MAP false
+#define BENCHMARK false
 
 #include "control.h"
+#include "bench.h"
 
-bool poll_future_triggered = false;
-void poll_future_handler(void*) {
-    poll_future_triggered = false;
-#if DEBUG
-        std::cout << "Timeout retriggered" << std::endl;
-#endif // DEBUG
-    //control::m->draw();
+// Download every tilt within a region into a pack
+// Arguments: <file> <lng1> <lat1> <lng2> <lat2> <z1> <z2>, in degrees
+int build_pack(char** args) {
+    auto [x1, y1] = map::Map::sphere_to_mercator(std::stod(args[1]), std::stod(args[2]));
+    auto [x2, y2] = map::Map::sphere_to_mercator(std::stod(args[3]), std::stod(args[4]));
+    httplib::Client cli(tilts::TILT_HOSTS.front());
+    cli.set_keep_alive(true);
+    auto fetch = [&](tilts::TiltId id) {
+        for (int attempt = 0; attempt < 3; attempt++) {
+            if (auto res = cli.Get(id.to_request_url())) {
+                if (res->status == 200) {
+                    return std::move(res->body);
+                }
+                if (res->status == 404) {
+                    break;
+                }
+            }
+        }
+        std::cout << "Skipped tilt " << id << std::endl;
+        return std::string();
+    };
+    auto count = tilts::TiltPack::build(args[0], std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2),
+        std::stoi(args[5]), std::stoi(args[6]), fetch);
+    std::cout << "Packed " << count << " tilts into " << args[0] << std::endl;
+    return count ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // Enables Fl::awake() from the download and decoding threads
+    Fl::lock();
+#if BENCHMARK
+    return bench::run();
+#endif // BENCHMARK
+
+    // Usage: map_main [--pack <file>]...
+    //        map_main --build-pack <file> <lng1> <lat1> <lng2> <lat2> <z1> <z2>
+    std::vector<std::string> packs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--build-pack" && i + 7 < argc) {
+            return build_pack(argv + i + 1);
+        } else if (arg == "--pack" && i + 1 < argc) {
+            packs.push_back(argv[++i]);
+        }
+    }
+
     Fl::visual(FL_DOUBLE | FL_RGB);
     fl_register_images();
     Fl::scheme("gtk+");
@@ -48,28 +109,18 @@ int main() {
     control::win->color(FL_LIGHT3);
     control::area_list = new control::Fl_Area_List(1020, 20, 255, 700);
     control::new_area_control = new control::Fl_New_Area_Control(1020, 590, 240, 190);
-    control::m = new map::Fl_Map(0, 0, 1000, 800);
+    control::m = new map::Fl_Map(0, 0, 1000, 800, tilts::default_source(packs));
     control::areas = control::m->areas;
     control::new_area_control->link();
+    control::m->callback(control::Fl_New_Area_Control::map_cb, control::new_area_control);
     control::new_area_control->take_focus();
     control::win->end();
     control::win->show();
 
     while (true) {
-        auto [poll, updated] = control::m->poll_futures();
-        if (control::m->redraw_flag || updated) {
-            control::win->redraw();
-            //control::m->draw();
-            if (control::areas->temp) {
-                control::new_area_control->update_size();
-            }
-        }
-        if (poll) {
-            if (!poll_future_triggered) {
-                poll_future_triggered = true;
-                Fl::add_timeout(0.2, poll_future_handler);
-            }
-        }
+        // Landed tilts only damage their own part of the map
+        control::m->poll_futures();
+        // Sleeps until user input, a worker's Fl::awake() or a retry timeout
         auto nWin = Fl::wait();
         if (nWin == 0) {
             break;
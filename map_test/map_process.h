@@ -15,6 +15,9 @@ namespace map {
     //  Spherical coordinate:     lambda [-180, 180] *      phi [ 90,-90]
     //
 
+    // Tilt levels the map zooms between, fallback and prefetched tilts stay within them too
+    const int MIN_LEVEL = 3, MAX_LEVEL = 18;
+
     // The base class about the map's coordinate operations and transformations
     class Map {
     public:
@@ -71,15 +74,15 @@ namespace map {
             auto [tx, ty] = cursor_mercator(mx, my);
 
             double k1 = k * factor;
-            // Scaling range limit: [3, 18]
+            // Scaling range limit: [MIN_LEVEL, MAX_LEVEL]
             if (k1 >= 2) {
-                if (z >= 18) {
+                if (static_cast<int>(z) >= MAX_LEVEL) {
                     return false;
                 }
                 z += 1;
                 k = k1 / 2;
             } else if (k1 < 1) {
-                if (z <= 3) {
+                if (static_cast<int>(z) <= MIN_LEVEL) {
                     return false;
                 }
                 z -= 1;
@@ -0,0 +1,179 @@
+#pragma once
+//
+//  metrics.h
+//
+//  In-process metrics: counters, gauges and log-bucketed latency histograms
+//  Recording is lock-free and safe from any thread, metrics are created once by name in a global registry
+//
+
+namespace metrics {
+    using clock = std::chrono::steady_clock;
+
+    class Counter {
+        std::atomic<uint64_t> n = 0;
+
+    public:
+        void add(uint64_t v = 1) { n.fetch_add(v, std::memory_order_relaxed); }
+        uint64_t value() const { return n.load(std::memory_order_relaxed); }
+    };
+
+    class Gauge {
+        std::atomic<int64_t> v = 0;
+
+    public:
+        void set(int64_t x) { v.store(x, std::memory_order_relaxed); }
+        int64_t value() const { return v.load(std::memory_order_relaxed); }
+    };
+
+    // HDR-style histogram: exact below 16, then 8 buckets per power of two (at most 12.5% error)
+    class Histogram {
+        static constexpr int SUB_BITS = 3, SUB = 1 << SUB_BITS, EXACT = 2 * SUB;
+        static constexpr int BUCKETS = EXACT + (64 - SUB_BITS - 1) * SUB;
+
+        std::array<std::atomic<uint64_t>, BUCKETS> buckets = {};
+        std::atomic<uint64_t> n = 0, sum = 0, top = 0;
+
+        static int bucket(uint64_t v) {
+            if (v < EXACT) {
+                return static_cast<int>(v);
+            }
+            int msb = 63 - std::countl_zero(v);
+            int sub = static_cast<int>(v >> (msb - SUB_BITS)) & (SUB - 1);
+            return EXACT + (msb - SUB_BITS - 1) * SUB + sub;
+        }
+
+        // Largest value falling into a bucket
+        static uint64_t upper(int b) {
+            if (b < EXACT) {
+                return b;
+            }
+            int msb = (b - EXACT) / SUB + SUB_BITS + 1, sub = (b - EXACT) % SUB;
+            return ((uint64_t(SUB + sub + 1)) << (msb - SUB_BITS)) - 1;
+        }
+
+    public:
+        void record(uint64_t v) {
+            buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+            n.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(v, std::memory_order_relaxed);
+            for (auto m = top.load(std::memory_order_relaxed); v > m && !top.compare_exchange_weak(m, v);) {
+            }
+        }
+
+        uint64_t count() const { return n.load(std::memory_order_relaxed); }
+        uint64_t max() const { return top.load(std::memory_order_relaxed); }
+        double mean() const { return count() ? double(sum.load(std::memory_order_relaxed)) / count() : 0; }
+
+        // Upper bound of the bucket holding the p-th quantile, p in [0, 1]
+        uint64_t percentile(double p) const {
+            auto total = count();
+            if (!total) {
+                return 0;
+            }
+            auto rank = static_cast<uint64_t>(std::ceil(p * total));
+            uint64_t seen = 0;
+            for (int b = 0; b < BUCKETS; b++) {
+                seen += buckets[b].load(std::memory_order_relaxed);
+                if (seen >= std::max<uint64_t>(rank, 1)) {
+                    return std::min(upper(b), max());
+                }
+            }
+            return max();
+        }
+    };
+
+    // Records the time spent in a scope, in microseconds
+    class ScopedTimer {
+        Histogram& h;
+        clock::time_point start = clock::now();
+
+    public:
+        ScopedTimer(Histogram& h) : h(h) {}
+        ~ScopedTimer() {
+            h.record(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count());
+        }
+    };
+
+    // Metrics by name, created on first use and never removed
+    // Counters named `x.hits` and `x.misses` are reported together as a hit ratio of `x`
+    class Registry {
+        mutable std::mutex mtx;
+        std::map<std::string, std::unique_ptr<Counter>> counters;
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        clock::time_point started = clock::now();
+
+        template <typename T>
+        T& get(std::map<std::string, std::unique_ptr<T>>& m, const std::string& name) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto& p = m[name];
+            if (!p) {
+                p = std::make_unique<T>();
+            }
+            return *p;
+        }
+
+    public:
+        Counter& counter(const std::string& name) { return get(counters, name); }
+        Gauge& gauge(const std::string& name) { return get(gauges, name); }
+        Histogram& histogram(const std::string& name) { return get(histograms, name); }
+
+        // One line per metric, histograms in microseconds
+        std::vector<std::string> lines() const {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::vector<std::string> out;
+            std::ostringstream s;
+            auto flush = [&] {
+                out.push_back(s.str());
+                s.str("");
+            };
+            s << std::fixed << std::setprecision(1);
+            for (auto& [name, c] : counters) {
+                auto dot = name.rfind('.');
+                if (dot != std::string::npos && name.substr(dot) == ".misses" &&
+                    counters.count(name.substr(0, dot) + ".hits")) {
+                    continue;
+                }
+                if (dot != std::string::npos && name.substr(dot) == ".hits") {
+                    auto misses = counters.find(name.substr(0, dot) + ".misses");
+                    if (misses != counters.end()) {
+                        uint64_t h = c->value(), m = misses->second->value();
+                        s << name.substr(0, dot) << " hit ratio " << (h + m ? 100.0 * h / (h + m) : 0.0)
+                            << "% (" << h << " / " << h + m << ")";
+                        flush();
+                        continue;
+                    }
+                }
+                s << name << " " << c->value();
+                flush();
+            }
+            for (auto& [name, g] : gauges) {
+                s << name << " " << g->value();
+                flush();
+            }
+            for (auto& [name, h] : histograms) {
+                s << name << " n " << h->count() << ", mean " << h->mean() << ", p50 " << h->percentile(0.5)
+                    << ", p99 " << h->percentile(0.99) << ", max " << h->max();
+                flush();
+            }
+            return out;
+        }
+
+        // Append a snapshot of every metric to a file
+        bool dump(const std::string& path) const {
+            std::ofstream out(path, std::ios::app);
+            out << "# metrics after " << std::chrono::duration_cast<std::chrono::seconds>(clock::now() - started).count()
+                << " s" << std::endl;
+            for (auto& l : lines()) {
+                out << l << std::endl;
+            }
+            out << std::endl;
+            return static_cast<bool>(out);
+        }
+    };
+
+    inline Registry& registry() {
+        static Registry r;
+        return r;
+    }
+} // namespace metrics
@@ -159,6 +159,14 @@ namespace area {
             bbox1(other.bbox1), bbox2(other.bbox2), temp_point(other.temp_point), area_size(other.area_size) {}
 
         Vec2d center() const { return Vec2d((bbox1.x + bbox2.x) / 2, (bbox1.y + bbox2.y) / 2); }
+        // Bounding box, stretched to the temporary point when it is drawn
+        std::pair<Vec2d, Vec2d> bounds(bool has_temp = false) const {
+            if (!has_temp || polygon.empty()) {
+                return { bbox1, bbox2 };
+            }
+            return { Vec2d(std::min(bbox1.x, temp_point.x), std::min(bbox1.y, temp_point.y)),
+                Vec2d(std::max(bbox2.x, temp_point.x), std::max(bbox2.y, temp_point.y)) };
+        }
 
         void set_temp(double x, double y) { temp_point.x = x, temp_point.y = y; }
         void reset_temp() {
@@ -0,0 +1,255 @@
+#pragma once
+//
+//  resample.h
+//
+//  Scaling of raw pixel buffers
+//  Bilinear when magnifying, box filter when minifying, each axis on its own
+//  Rows are filtered horizontally into 16-bit fixed point, then blended vertically with SSE2 or AVX2 when available
+//
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RESAMPLE_SSE2 1
+#endif
+#if defined(__AVX2__)
+#define RESAMPLE_AVX2 1
+#endif
+
+namespace resample {
+    // Weights are in 1/2^WEIGHT_BITS, filtered rows keep ROW_BITS of fraction so they fit in int16
+    const int WEIGHT_BITS = 14, ROW_BITS = 7;
+
+    // Source pixels contributing to each destination pixel along one axis
+    struct Taps {
+        // Taps per destination pixel, padded with zero weights
+        int n = 0;
+        std::vector<int> start;
+        std::vector<int16_t> weights;
+
+        // Destination pixel i covers source positions [x + i * step, x + (i + 1) * step)
+        Taps(int sn, int dn, double x, double step) {
+            n = std::min(step <= 1 ? 2 : static_cast<int>(std::ceil(step)) + 1, sn);
+            start.resize(dn);
+            weights.assign(static_cast<size_t>(dn) * n, 0);
+            std::vector<double> w(n);
+            for (int i = 0; i < dn; i++) {
+                std::fill(w.begin(), w.end(), 0.0);
+                int s;
+                double lo = std::clamp(x + i * step, 0.0, double(sn)), hi = std::clamp(x + (i + 1) * step, 0.0, double(sn));
+                if (step <= 1 || hi - lo <= 0) {
+                    // Bilinear between the two source pixels around the destination centre
+                    double c = std::clamp(x + (i + 0.5) * step - 0.5, 0.0, double(sn - 1));
+                    int x0 = static_cast<int>(c);
+                    double f = c - x0;
+                    s = std::min(x0, sn - n);
+                    w[x0 - s] += 1 - f;
+                    if (f > 0) {
+                        w[x0 + 1 - s] += f;
+                    }
+                } else {
+                    // Average of the source pixels covered, weighted by coverage
+                    s = std::min(static_cast<int>(lo), sn - n);
+                    for (int p = static_cast<int>(lo); p < std::min(static_cast<int>(std::ceil(hi)), sn); p++) {
+                        w[p - s] += (std::min(hi, p + 1.0) - std::max(lo, double(p))) / (hi - lo);
+                    }
+                }
+                start[i] = s;
+                // Rounded weights summing to exactly one
+                auto out = &weights[static_cast<size_t>(i) * n];
+                int sum = 0, top = 0;
+                for (int k = 0; k < n; k++) {
+                    out[k] = static_cast<int16_t>(std::lround(w[k] * (1 << WEIGHT_BITS)));
+                    sum += out[k];
+                    top = out[k] > out[top] ? k : top;
+                }
+                out[top] += static_cast<int16_t>((1 << WEIGHT_BITS) - sum);
+            }
+        }
+    };
+
+    namespace detail {
+        // One source row filtered horizontally into `dw` pixels of D channels, N taps when known at compile time
+        // Starts at destination pixel `first`, `out` pointing to it
+        template <int D, int N>
+        void horizontal(const uchar* in, const Taps& t, int16_t* out, int dw, int first = 0) {
+            const int round = 1 << (WEIGHT_BITS - ROW_BITS - 1), n = N ? N : t.n;
+            const int16_t* w = t.weights.data() + static_cast<size_t>(first) * n;
+            for (int i = first; i < first + dw; i++, w += n, out += D) {
+                const uchar* p = in + t.start[i] * D;
+                int acc[D];
+                for (int c = 0; c < D; c++) {
+                    acc[c] = round;
+                }
+                for (int k = 0; k < n; k++, p += D) {
+                    for (int c = 0; c < D; c++) {
+                        acc[c] += w[k] * p[c];
+                    }
+                }
+                for (int c = 0; c < D; c++) {
+                    out[c] = static_cast<int16_t>(acc[c] >> (WEIGHT_BITS - ROW_BITS));
+                }
+            }
+        }
+
+#if RESAMPLE_SSE2
+        // Bilinear filtering of 3 or 4 channel pixels, the channels of both taps interleaved for one madd
+        // Returns the number of pixels done, the rest is left to the scalar loop
+        template <int D>
+        int horizontal2_sse2(const uchar* in, const Taps& t, int16_t* out, int dw) {
+            const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - ROW_BITS - 1)), zero = _mm_setzero_si128();
+            auto load = [](const uchar* p) {
+                uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (D == 4 ? uint32_t(p[3]) << 24 : 0);
+                return _mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(v)), _mm_setzero_si128());
+            };
+            const int16_t* w = t.weights.data();
+            // The last pixel stays scalar, 3 channel pixels are stored as 4
+            int i = 0;
+            for (; i + 1 < dw; i++, w += 2, out += D) {
+                const uchar* p = in + t.start[i] * D;
+                __m128i px = _mm_unpacklo_epi16(load(p), load(p + D));
+                __m128i wk = _mm_set1_epi32(w[1] << 16 | static_cast<uint16_t>(w[0]));
+                __m128i v = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(px, wk), round), WEIGHT_BITS - ROW_BITS);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packs_epi32(v, zero));
+            }
+            return i;
+        }
+#endif // RESAMPLE_SSE2
+
+        template <int D>
+        void horizontal(const uchar* in, const Taps& t, int16_t* out, int dw, bool vectorized) {
+            if (t.n != 2) {
+                horizontal<D, 0>(in, t, out, dw);
+                return;
+            }
+            int i = 0;
+#if RESAMPLE_SSE2
+            if (D >= 3 && vectorized) {
+                i = horizontal2_sse2<std::max(D, 3)>(in, t, out, dw);
+            }
+#endif // RESAMPLE_SSE2
+            horizontal<D, 2>(in, t, out + i * D, dw - i, i);
+        }
+
+        inline void horizontal(const uchar* in, int d, const Taps& t, int16_t* out, int dw, bool vectorized) {
+            switch (d) {
+            case 1: horizontal<1>(in, t, out, dw, vectorized); break;
+            case 2: horizontal<2>(in, t, out, dw, vectorized); break;
+            case 3: horizontal<3>(in, t, out, dw, vectorized); break;
+            default: horizontal<4>(in, t, out, dw, vectorized); break;
+            }
+        }
+
+        const int SHIFT = WEIGHT_BITS + ROW_BITS, ROUND = 1 << (SHIFT - 1);
+
+        // Weighted sum of `n` filtered rows into bytes, from element `x` on
+        inline void vertical_scalar(const int16_t* const* rows, const int16_t* w, int n, uchar* out, int x, int len) {
+            for (; x < len; x++) {
+                int acc = ROUND;
+                for (int k = 0; k < n; k++) {
+                    acc += w[k] * rows[k][x];
+                }
+                out[x] = static_cast<uchar>(std::clamp(acc >> SHIFT, 0, 255));
+            }
+        }
+
+#if RESAMPLE_SSE2
+        // Pairs of rows are interleaved so that each madd applies two taps
+        inline int vertical_sse2(const int16_t* const* rows, const int16_t* w, int n, uchar* out, int len) {
+            const __m128i round = _mm_set1_epi32(ROUND), zero = _mm_setzero_si128();
+            int x = 0;
+            for (; x + 8 <= len; x += 8) {
+                __m128i lo = round, hi = round;
+                for (int k = 0; k < n; k += 2) {
+                    bool pair = k + 1 < n;
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k] + x));
+                    __m128i b = pair ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[k + 1] + x)) : zero;
+                    __m128i wk = _mm_set1_epi32((pair ? w[k + 1] << 16 : 0) | static_cast<uint16_t>(w[k]));
+                    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+                    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+                }
+                __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, SHIFT), _mm_srai_epi32(hi, SHIFT));
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(v, v));
+            }
+            return x;
+        }
+#endif // RESAMPLE_SSE2
+
+#if RESAMPLE_AVX2
+        inline int vertical_avx2(const int16_t* const* rows, const int16_t* w, int n, uchar* out, int len) {
+            const __m256i round = _mm256_set1_epi32(ROUND), zero = _mm256_setzero_si256();
+            int x = 0;
+            for (; x + 16 <= len; x += 16) {
+                __m256i lo = round, hi = round;
+                for (int k = 0; k < n; k += 2) {
+                    bool pair = k + 1 < n;
+                    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + x));
+                    __m256i b = pair ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k + 1] + x)) : zero;
+                    __m256i wk = _mm256_set1_epi32((pair ? w[k + 1] << 16 : 0) | static_cast<uint16_t>(w[k]));
+                    lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wk));
+                    hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wk));
+                }
+                // Unpacking and packing both work within 128-bit lanes, which restores the order
+                __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, SHIFT), _mm256_srai_epi32(hi, SHIFT));
+                v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm256_castsi256_si128(v));
+            }
+            return x;
+        }
+#endif // RESAMPLE_AVX2
+
+        inline void vertical(const int16_t* const* rows, const int16_t* w, int n, uchar* out, int len, bool vectorized) {
+            int x = 0;
+            if (vectorized) {
+#if RESAMPLE_AVX2
+                x = vertical_avx2(rows, w, n, out, len);
+#elif RESAMPLE_SSE2
+                x = vertical_sse2(rows, w, n, out, len);
+#endif
+            }
+            vertical_scalar(rows, w, n, out, x, len);
+        }
+    } // namespace detail
+
+    // Instruction set used by scale()
+    inline const char* instruction_set() {
+#if RESAMPLE_AVX2
+        return "AVX2";
+#elif RESAMPLE_SSE2
+        return "SSE2";
+#else
+        return "scalar";
+#endif
+    }
+
+    // Scaling of a (sw, sh) region with `ld` bytes per line into a packed (dw, dh) buffer, both with `d` bytes per pixel
+    // Destination pixel (i, j) covers the source square of side `step` at (x + i * step, y + j * step)
+    // Channels are filtered independently, so RGBA should have the colour of neighbouring pixels under transparent ones
+    inline void scale_region(const uchar* src, int sw, int sh, int ld, int d, uchar* dst, int dw, int dh,
+        double x, double y, double step_x, double step_y, bool vectorized = true) {
+        if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0) {
+            return;
+        }
+        Taps tx(sw, dw, x, step_x), ty(sh, dh, y, step_y);
+        // Only the source rows used
+        int y0 = ty.start.front(), y1 = ty.start.back() + ty.n;
+        int len = dw * d;
+        thread_local std::vector<int16_t> filtered;
+        thread_local std::vector<const int16_t*> rows;
+        filtered.resize(static_cast<size_t>(y1 - y0) * len);
+        for (int r = y0; r < y1; r++) {
+            detail::horizontal(src + static_cast<size_t>(r) * ld, d, tx, &filtered[static_cast<size_t>(r - y0) * len], dw, vectorized);
+        }
+        rows.resize(ty.n);
+        for (int j = 0; j < dh; j++) {
+            for (int k = 0; k < ty.n; k++) {
+                rows[k] = &filtered[static_cast<size_t>(ty.start[j] + k - y0) * len];
+            }
+            detail::vertical(rows.data(), &ty.weights[static_cast<size_t>(j) * ty.n], ty.n, dst + static_cast<size_t>(j) * len,
+                len, vectorized);
+        }
+    }
+
+    // Scaling of a whole (sw, sh) region to (dw, dh)
+    inline void scale(const uchar* src, int sw, int sh, int ld, int d, uchar* dst, int dw, int dh, bool vectorized = true) {
+        scale_region(src, sw, sh, ld, d, dst, dw, dh, 0, 0, double(sw) / dw, double(sh) / dh, vectorized);
+    }
+} // namespace resample
@@ -8,6 +8,17 @@
 
 namespace tilts {
     const int TILT_SIZE = 256;
+    // Default number of concurrent download workers
+    const int DOWNLOAD_WORKERS = 8;
+    // Seconds to wait for a connection, also bounding how long shutdown waits for a worker still connecting
+    const int CONNECT_TIMEOUT = 3;
+    // Tile servers, sharing the load of downloading
+    const std::vector<std::string> TILT_HOSTS = {
+        "http://webrd01.is.autonavi.com", "http://webrd02.is.autonavi.com",
+        "http://webrd03.is.autonavi.com", "http://webrd04.is.autonavi.com",
+    };
+    // Status of a download dropped before it was sent
+    const int STATUS_CANCELLED = -2;
 
     class TiltId {
     public:
@@ -30,122 +41,286 @@ namespace tilts {
                 (z == rhs.z && x == rhs.x && y < rhs.y);
         }
 
+        // Packed 64-bit key for hashing: z in the top 6 bits, then 29 bits each of x and y
+        uint64_t key() const {
+            const uint64_t mask = (1ull << 29) - 1;
+            return uint64_t(z) << 58 | (uint64_t(x) & mask) << 29 | (uint64_t(y) & mask);
+        }
+
         TiltId offset(int i, int j) { return TiltId{ .x = x + i, .y = y + j, .z = z }; }
 
+        // Tilt `levels` levels up that covers this one
+        TiltId parent(int levels = 1) const { return TiltId{ .x = x >> levels, .y = y >> levels, .z = z - levels }; }
+        // One of the four tilts a level down, c = 0..3 in row-major order
+        TiltId child(int c) const { return TiltId{ .x = x * 2 + c % 2, .y = y * 2 + c / 2, .z = z + 1 }; }
+
         friend std::ostream& operator<<(std::ostream& os, TiltId id) {
             os << "(" << id.x << ", " << id.y << ", " << id.z << ")";
             return os;
         }
     };
 
+    // Immutable png data of a tilt, shared between the caches and the decoder
+    using TiltBuffer = std::shared_ptr<const std::string>;
+
+    // View of png data, kept alive by `owner` when set
+    // Views without an owner are only valid until the next call into the provider that returned them
     struct TiltData {
         const unsigned char* buf;
         size_t size;
+        std::shared_ptr<const void> owner;
 
     public:
         TiltData() : size(0), buf(nullptr) {}
-        TiltData(const unsigned char* buf, size_t size) : size(size), buf(buf) {}
+        TiltData(const unsigned char* buf, size_t size, std::shared_ptr<const void> owner = nullptr)
+            : size(size), buf(buf), owner(std::move(owner)) {}
+        TiltData(const TiltBuffer& data) : size(data->size()), buf((const unsigned char*)data->data()), owner(data) {}
+
+        // A view that stays valid on its own, copying the data only when it has no owner
+        TiltData retain() const {
+            if (owner || !size) {
+                return *this;
+            }
+            return TiltData(std::make_shared<const std::string>((const char*)buf, size));
+        }
+    };
+
+    // HTTP validators of tilt data and when it was last fetched or revalidated
+    struct TiltMeta {
+        std::string etag, last_modified;
+        // Seconds since the epoch, 0 when unknown
+        int64_t fetched = 0;
+
+        static int64_t now() {
+            return std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+    };
+
+    // Visible region of the map plus a prefetch margin, in tilts of level z
+    struct TiltViewport {
+        int z = -1;
+        double cx = 0, cy = 0, hw = 0, hh = 0;
+        // Extra distance given to tilts of other levels
+        static constexpr double ZOOM_PENALTY = 4;
+
+        bool operator==(const TiltViewport&) const = default;
+
+        // Offset from the center to a tilt's center, and the tilt's span, in tilts of level z
+        std::tuple<double, double, double> locate(TiltId id) const {
+            double span = std::ldexp(1.0, z - id.z);
+            double n = std::ldexp(1.0, z);
+            double dx = (id.x + 0.5) * span - cx, dy = (id.y + 0.5) * span - cy;
+            // The map wraps around horizontally
+            dx -= n * std::floor(dx / n + 0.5);
+            return { dx, dy, span };
+        }
+
+        // Whether a tilt is still worth downloading
+        bool contains(TiltId id) const {
+            if (z < 0) {
+                return true;
+            }
+            auto [dx, dy, span] = locate(id);
+            return std::abs(id.z - z) <= 1 && std::abs(dx) < hw + span / 2 && std::abs(dy) < hh + span / 2;
+        }
+
+        // Lower for tilts to be downloaded first
+        double priority(TiltId id) const {
+            if (z < 0) {
+                return 0;
+            }
+            auto [dx, dy, span] = locate(id);
+            return std::hypot(dx, dy) + std::abs(id.z - z) * ZOOM_PENALTY;
+        }
     };
 
     struct TiltFuture {
-        std::atomic_bool available;
         TiltId id;
         int status;
+        double priority = 0;
         std::string data;
+        // Validators sent with a revalidation, then those of the response
+        TiltMeta meta;
+        // Whether cached data is being checked, answered with 304 when unchanged
+        bool revalidate = false;
+        std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+        // Link in the completion queue
+        TiltFuture* next = nullptr;
 
-        TiltFuture(TiltId id) : available(false), status(-1), id(id) {}
+        TiltFuture(TiltId id) : status(-1), id(id) {}
 
         static void makeRequest(httplib::Client* cli, std::string url, TiltFuture* future) {
-            if (auto res = cli->Get(url)) {
+            httplib::Headers headers;
+            if (!future->meta.etag.empty()) {
+                headers.emplace("If-None-Match", future->meta.etag);
+            }
+            if (!future->meta.last_modified.empty()) {
+                headers.emplace("If-Modified-Since", future->meta.last_modified);
+            }
+            if (auto res = cli->Get(url, headers)) {
                 if (res->status == 200) {
                     future->data = std::move(res->body);
                 }
+                if (res->status == 200 || res->status == 304) {
+                    if (res->has_header("ETag")) {
+                        future->meta.etag = res->get_header_value("ETag");
+                    }
+                    if (res->has_header("Last-Modified")) {
+                        future->meta.last_modified = res->get_header_value("Last-Modified");
+                    }
+                    future->meta.fetched = TiltMeta::now();
+                }
                 future->status = res->status;
             }
-            future->available.store(true);
         }
     };
 
-    class TiltsSource {
-        std::map<TiltId, std::string> tilts;
-        std::list<TiltId> cached;
-        std::list<TiltFuture*> futures;
-        std::set<TiltId> downloading;
-        int size;
-        httplib::Client cli;
+    // Lock-free multi-producer single-consumer queue of intrusively linked nodes
+    // Producers push one node at a time, the consumer takes everything at once
+    template <typename T>
+    class CompletionQueue {
+        std::atomic<T*> head = nullptr;
 
     public:
-        TiltsSource(int size) : cli("http://webrd03.is.autonavi.com"), size(size) {}
+        // Called by the push onto an empty queue, so the consumer is woken once per batch
+        // Set before the first push
+        std::function<void()> notify;
 
-        bool cacheHas(TiltId id) { return tilts.find(id) != tilts.end(); }
-        bool isDownloading(TiltId id) {
-            return downloading.find(id) != downloading.end();
+        void push(T* node) {
+            // The node belongs to the consumer once published, so only the local copy of the old head is checked
+            T* old = head.load(std::memory_order_relaxed);
+            do {
+                node->next = old;
+            } while (!head.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed));
+            if (!old && notify) {
+                notify();
+            }
         }
 
-        void download(TiltId id) {
-            if (cacheHas(id) || isDownloading(id)) {
-                return;
+        // Take all pushed nodes, oldest first
+        T* drain() {
+            T* node = head.exchange(nullptr, std::memory_order_acquire);
+            T* prev = nullptr;
+            while (node) {
+                auto next = node->next;
+                node->next = prev;
+                prev = node;
+                node = next;
             }
-
-            auto future = new TiltFuture(id);
-            std::thread th(TiltFuture::makeRequest, &cli, id.to_request_url(), future);
-            th.detach();
-            futures.push_back(future);
-            downloading.insert(id);
+            return prev;
         }
+    };
 
-        std::tuple<bool, bool> pollFutures() {
-            if (futures.empty()) {
-                return { false,false };
-            }
-            auto front = futures.front();
-            futures.pop_front();
+    // Fixed-size pool of download workers sharing one request queue
+    // Every worker owns its own keep-alive connection, spread round-robin over the hosts
+    // Idle workers take the next request, so the least loaded connections serve first
+    // Requests are served nearest to the viewport center first
+    class TiltDownloader {
+        std::vector<std::unique_ptr<httplib::Client>> clients;
+        std::vector<std::thread> workers;
+        // Heap of queued requests, ordered by `later`
+        std::vector<TiltFuture*> requests;
+        TiltViewport viewport;
+        CompletionQueue<TiltFuture>& done;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stopping = false;
 
-            auto oldFuturesCnt = futures.size();
-            auto updated = false;
-            if (front->available.load()) {
+        // Revalidations of cached tilts wait for missing ones
+        static constexpr double REVALIDATE_PENALTY = TiltViewport::ZOOM_PENALTY;
 
-                if (front->status == 200) {
-                    while (cached.size() >= size) {
-                        tilts.erase(cached.front());
-                        cached.pop_front();
-                    }
+        static bool later(const TiltFuture* a, const TiltFuture* b) { return a->priority > b->priority; }
 
-                    cached.push_back(front->id);
-                    tilts[front->id] = front->data;
-                    downloading.erase(front->id);
-                    updated = true;
-#if DEBUG
-                    std::cout << "Downloaded tilt " << front->id << std::endl;
-#endif // DEBUG
-
-                    // invalid status code
-                } else {
-#if DEBUG
-                    std::cout << "Download tilt " << front->id
-                        << " failed with status code" << front->status << std::endl;
-#endif // DEBUG
-                }
+        double rank(const TiltFuture* f) const {
+            return viewport.priority(f->id) + (f->revalidate ? REVALIDATE_PENALTY : 0);
+        }
 
-                delete front;
+        void work(httplib::Client* cli) {
+            while (true) {
+                TiltFuture* future;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this] { return stopping || !requests.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    std::pop_heap(requests.begin(), requests.end(), later);
+                    future = requests.back();
+                    requests.pop_back();
+                }
+                TiltFuture::makeRequest(cli, future->id.to_request_url(), future);
+                done.push(future);
+            }
+        }
 
-                // unavailable
-            } else {
-                futures.push_back(front);
+    public:
+        TiltDownloader(const std::vector<std::string>& hosts, int concurrency, CompletionQueue<TiltFuture>& done)
+            : done(done) {
+            for (int i = 0; i < std::max(concurrency, 1); i++) {
+                auto cli = new httplib::Client(hosts[i % hosts.size()]);
+                cli->set_keep_alive(true);
+                // Client::stop() cannot interrupt a connect in progress
+                cli->set_connection_timeout(CONNECT_TIMEOUT);
+                clients.emplace_back(cli);
             }
+            for (auto& cli : clients) {
+                workers.emplace_back(&TiltDownloader::work, this, cli.get());
+            }
+        }
 
-            return { oldFuturesCnt < futures.size(),updated };
+        ~TiltDownloader() { shutdown(); }
+
+        void push(TiltFuture* future) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                future->priority = rank(future);
+                requests.push_back(future);
+                std::push_heap(requests.begin(), requests.end(), later);
+            }
+            cv.notify_one();
         }
 
-        TiltData get(TiltId id) {
-            download(id);
-            pollFutures();
+        // Reorder queued requests for a new viewport
+        // Requests out of the viewport are cancelled and handed back through the completion queue
+        void setViewport(const TiltViewport& v) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (viewport == v) {
+                return;
+            }
+            viewport = v;
+            auto kept = std::partition(requests.begin(), requests.end(),
+                [&](TiltFuture* f) { return viewport.contains(f->id); });
+            for (auto it = kept; it != requests.end(); ++it) {
+                (*it)->status = STATUS_CANCELLED;
+                done.push(*it);
+            }
+            requests.erase(kept, requests.end());
+            for (auto f : requests) {
+                f->priority = rank(f);
+            }
+            std::make_heap(requests.begin(), requests.end(), later);
+        }
 
-            if (cacheHas(id)) {
-                return TiltData((const unsigned char*)tilts[id].c_str(),
-                    tilts[id].size());
-            } else {
-                return TiltData();
+        // Stop all workers, aborting requests in flight and dropping queued ones
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (stopping) {
+                    return;
+                }
+                stopping = true;
+                for (auto f : requests) {
+                    delete f;
+                }
+                requests.clear();
+            }
+            cv.notify_all();
+            for (auto& cli : clients) {
+                cli->stop();
+            }
+            for (auto& th : workers) {
+                th.join();
             }
         }
     };
@@ -0,0 +1,431 @@
+#pragma once
+//
+//  tilts_cache.h
+//
+//  Persistent tilt cache on disk
+//  Tilts are appended to a single pack file, located by an index that is memory-mapped at startup
+//  Appends are batched in memory and written once per poll, compaction runs on a worker thread
+//  Every record keeps the data version, fetch time and HTTP validators for revalidation
+//
+
+#include "tilts.h"
+#include "tilts_provider.h"
+
+namespace tilts {
+    // Default location and size cap of the disk cache
+    const char* const DISK_CACHE_PATH = "tilts_cache";
+    const uint64_t DISK_CACHE_SIZE = 256ull << 20;
+    // Seconds after which cached tilts are served stale and revalidated in the background
+    const int64_t TILT_MAX_AGE = 7 * 24 * 3600;
+
+    class TiltsDiskCache {
+        static constexpr uint32_t RECORD_MAGIC = 0x32544c54;  // "TLT2"
+        static constexpr uint32_t INDEX_MAGIC = 0x32584449;   // "IDX2"
+        // Batched records are written early beyond this size
+        static constexpr size_t FLUSH_BYTES = 1 << 20;
+
+        // Header of each record in the pack file, followed by the etag, last modified date and `size` bytes of png data
+        struct Record {
+            uint32_t magic;
+            int32_t x, y, z;
+            char udt[8];
+            int64_t fetched;
+            uint16_t etag_size, modified_size;
+            uint32_t size;
+        };
+        // Header of the index file, followed by `count` entries
+        struct IndexHeader {
+            uint32_t magic;
+            uint32_t count;
+            char udt[8];
+            uint64_t pack_size;
+            uint64_t tick;
+        };
+        struct IndexEntry {
+            int32_t x, y, z;
+            uint32_t size;
+            uint64_t offset;
+            uint64_t last_use;
+            int64_t fetched;
+            uint32_t head, reserved;
+        };
+        // Location of a tilt's record inside the pack, data starts `head` bytes in
+        struct Slot {
+            uint64_t offset;
+            uint32_t size, head;
+            uint64_t last_use;
+            int64_t fetched;
+        };
+
+        // Pack rewritten by a worker, swapped in by the UI thread once `done` is set
+        struct Compaction {
+            // Pack size when it started, records from there on are put meanwhile
+            uint64_t from = 0, size = 0;
+            std::map<TiltId, uint64_t> offsets;
+            bool ok = false;
+            std::atomic<bool> done = false;
+        };
+
+        std::string pack_path, index_path;
+        char udt[8] = {};
+        std::map<TiltId, Slot> index;
+        httplib::detail::mmap pack;
+        // Whether a view is mapped, it may end before records written since
+        bool mapped = false;
+        // Records put since the last flush, at offsets from `written` on
+        std::string pending;
+        uint64_t pack_size = 0, written = 0, max_size;
+        std::thread compactor;
+        Compaction compaction;
+        // Logical clock for LRU ordering
+        uint64_t tick = 0;
+        bool enabled = false;
+
+        template <typename T>
+        static T read_at(const char* p) {
+            T t;
+            std::memcpy(&t, p, sizeof(T));
+            return t;
+        }
+
+        bool map_pack() {
+            if (!mapped) {
+                mapped = pack.open(pack_path.c_str()) && pack.size() >= written;
+            }
+            return mapped;
+        }
+
+        void unmap_pack() {
+            pack.close();
+            mapped = false;
+        }
+
+        // Start of a record, in the batch not written yet or in the pack, mapped again once it has grown past the view
+        const char* record(const Slot& s) {
+            if (s.offset >= written) {
+                return pending.data() + (s.offset - written);
+            }
+            if (mapped && pack.size() < s.offset + s.head + s.size) {
+                unmap_pack();
+            }
+            return map_pack() ? pack.data() + s.offset : nullptr;
+        }
+
+        // Load the index file, returns the pack size it covers
+        uint64_t load_index() {
+            httplib::detail::mmap idx(index_path.c_str());
+            if (!idx.is_open() || idx.size() < sizeof(IndexHeader)) {
+                return 0;
+            }
+            auto header = read_at<IndexHeader>(idx.data());
+            if (header.magic != INDEX_MAGIC || std::memcmp(header.udt, udt, sizeof(udt)) != 0 ||
+                header.pack_size > pack_size ||
+                idx.size() < sizeof(IndexHeader) + header.count * sizeof(IndexEntry)) {
+                return 0;
+            }
+            auto entries = idx.data() + sizeof(IndexHeader);
+            for (uint32_t i = 0; i < header.count; i++) {
+                auto e = read_at<IndexEntry>(entries + i * sizeof(IndexEntry));
+                index[TiltId{ .x = e.x, .y = e.y, .z = e.z }] = { e.offset, e.size, e.head, e.last_use, e.fetched };
+            }
+            tick = header.tick;
+            return header.pack_size;
+        }
+
+        // Scan records appended after the indexed part of the pack, e.g. after a crash
+        void scan_pack(uint64_t from) {
+            if (from == pack_size || !map_pack()) {
+                return;
+            }
+            auto offset = from;
+            while (offset + sizeof(Record) <= pack_size) {
+                auto r = read_at<Record>(pack.data() + offset);
+                uint32_t head = sizeof(Record) + r.etag_size + r.modified_size;
+                if (r.magic != RECORD_MAGIC || offset + head + r.size > pack_size) {
+                    break;
+                }
+                if (std::memcmp(r.udt, udt, sizeof(udt)) == 0) {
+                    index[TiltId{ .x = r.x, .y = r.y, .z = r.z }] = { offset, r.size, head, ++tick, r.fetched };
+                }
+                offset += head + r.size;
+            }
+            if (offset < pack_size) {
+                // Drop the truncated tail so that new records stay reachable
+#if DEBUG
+                std::cout << "Disk cache truncated at " << offset << std::endl;
+#endif // DEBUG
+                unmap_pack();
+                std::error_code ec;
+                std::filesystem::resize_file(pack_path, offset, ec);
+                pack_size = written = offset;
+            }
+        }
+
+        void save_index() {
+            std::ofstream out(index_path, std::ios::binary | std::ios::trunc);
+            IndexHeader header = { INDEX_MAGIC, static_cast<uint32_t>(index.size()), {}, pack_size, tick };
+            std::memcpy(header.udt, udt, sizeof(udt));
+            out.write((const char*)&header, sizeof(header));
+            for (auto& [id, s] : index) {
+                IndexEntry e = { id.x, id.y, id.z, s.size, s.offset, s.last_use, s.fetched, s.head, 0 };
+                out.write((const char*)&e, sizeof(e));
+            }
+        }
+
+        // Write the batched records to the pack in one go, deferred while a compaction reads it
+        void flush() {
+            if (pending.empty() || compactor.joinable()) {
+                return;
+            }
+#if defined(_WIN32)
+            // Windows refuses to write a file while it is mapped
+            unmap_pack();
+#endif // _WIN32
+            std::ofstream out(pack_path, std::ios::binary | std::ios::app);
+            out.write(pending.data(), pending.size());
+            out.close();
+            if (out) {
+                written += pending.size();
+            } else {
+                // Roll back the partial batch, losing its tilts
+                std::error_code ec;
+                std::filesystem::resize_file(pack_path, written, ec);
+                std::erase_if(index, [&](auto& e) { return e.second.offset >= written; });
+                pack_size = written;
+            }
+            pending.clear();
+        }
+
+        // Rewrite the pack with the most recently used tilts only, on a worker reading its own view of the pack
+        void start_compaction() {
+            flush();
+            if (compactor.joinable() || !pending.empty()) {
+                return;
+            }
+            std::vector<std::pair<TiltId, Slot>> entries(index.begin(), index.end());
+            std::sort(entries.begin(), entries.end(),
+                [](auto& a, auto& b) { return a.second.last_use > b.second.last_use; });
+            compaction.from = written;
+            compaction.size = 0;
+            compaction.offsets.clear();
+            compaction.ok = false;
+            compaction.done = false;
+            compactor = std::thread([this, entries = std::move(entries)] {
+                auto& c = compaction;
+                httplib::detail::mmap src(pack_path.c_str());
+                if (src.is_open() && src.size() >= c.from) {
+                    std::ofstream out(pack_path + ".tmp", std::ios::binary | std::ios::trunc);
+                    for (auto& [id, s] : entries) {
+                        uint64_t len = s.head + s.size;
+                        if (c.size + len > max_size / 4 * 3) {
+                            break;
+                        }
+                        // The index may hold a newer fetch time than the record
+                        auto r = read_at<Record>(src.data() + s.offset);
+                        r.fetched = s.fetched;
+                        out.write((const char*)&r, sizeof(r));
+                        out.write(src.data() + s.offset + sizeof(Record), len - sizeof(Record));
+                        c.offsets[id] = c.size;
+                        c.size += len;
+                    }
+                    out.close();
+                    c.ok = static_cast<bool>(out);
+                }
+                c.done.store(true, std::memory_order_release);
+            });
+        }
+
+        // Swap in the compacted pack once the worker is done, or waiting for it
+        void finish_compaction(bool wait = false) {
+            auto& c = compaction;
+            if (!compactor.joinable() || (!wait && !c.done.load(std::memory_order_acquire))) {
+                return;
+            }
+            compactor.join();
+            auto tmp_path = pack_path + ".tmp";
+            std::error_code ec;
+            if (c.ok) {
+                unmap_pack();
+                std::filesystem::rename(tmp_path, pack_path, ec);
+            }
+            if (!c.ok || ec) {
+                std::filesystem::remove(tmp_path, ec);
+                flush();
+                return;
+            }
+#if DEBUG
+            std::cout << "Disk cache compacted from " << c.from << " to " << c.size
+                << " bytes, " << c.offsets.size() << " tilts kept" << std::endl;
+#endif // DEBUG
+            // Kept records move to their new place, records put meanwhile follow them
+            std::map<TiltId, Slot> kept;
+            for (auto& [id, s] : index) {
+                if (s.offset >= c.from) {
+                    kept[id] = s;
+                    kept[id].offset = s.offset - c.from + c.size;
+                } else if (auto it = c.offsets.find(id); it != c.offsets.end()) {
+                    kept[id] = s;
+                    kept[id].offset = it->second;
+                }
+            }
+            index = std::move(kept);
+            written = c.size;
+            pack_size = written + pending.size();
+            flush();
+            save_index();
+        }
+
+    public:
+        TiltsDiskCache(const std::string& dir, const char* version, uint64_t max_size)
+            : pack_path(dir + "/tilts.pack"), index_path(dir + "/tilts.idx"), pack(""), max_size(max_size) {
+            std::strncpy(udt, version, sizeof(udt));
+            // No directory, no disk cache
+            if (dir.empty()) {
+                return;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            if (ec) {
+                return;
+            }
+            enabled = true;
+            pack_size = std::filesystem::exists(pack_path, ec) ? std::filesystem::file_size(pack_path, ec) : 0;
+            if (ec) {
+                pack_size = 0;
+            }
+            written = pack_size;
+            scan_pack(load_index());
+#if DEBUG
+            std::cout << "Disk cache opened with " << index.size() << " tilts, "
+                << pack_size << " bytes" << std::endl;
+#endif // DEBUG
+        }
+
+        ~TiltsDiskCache() {
+            if (enabled) {
+                finish_compaction(true);
+                flush();
+                unmap_pack();
+                save_index();
+            }
+        }
+
+        // Write the records put since the last call and pick up a finished compaction, from the UI thread
+        void commit() {
+            finish_compaction();
+            flush();
+        }
+
+        bool has(TiltId id) const { return index.find(id) != index.end(); }
+
+        // Zero-copy view into the mapped pack or the batch not written yet, valid until the cache is used again
+        // Not owned, as Windows refuses to write the pack while any view keeps it mapped
+        TiltData get(TiltId id) {
+            auto it = index.find(id);
+            auto p = it != index.end() ? record(it->second) : nullptr;
+            if (!p) {
+                return TiltData();
+            }
+            it->second.last_use = ++tick;
+            return TiltData((const unsigned char*)p + it->second.head, it->second.size);
+        }
+
+        // Validators and fetch time of a cached tilt
+        std::optional<TiltMeta> meta(TiltId id) {
+            auto it = index.find(id);
+            auto p = it != index.end() ? record(it->second) : nullptr;
+            if (!p) {
+                return std::nullopt;
+            }
+            auto r = read_at<Record>(p);
+            p += sizeof(Record);
+            TiltMeta m;
+            m.etag.assign(p, r.etag_size);
+            m.last_modified.assign(p + r.etag_size, r.modified_size);
+            m.fetched = it->second.fetched;
+            return m;
+        }
+
+        // Store a tilt, replacing an older version of it
+        // Batched in memory until commit(), or until the batch grows large
+        void put(TiltId id, const std::string& data, const TiltMeta& meta) {
+            if (!enabled) {
+                return;
+            }
+            auto etag = meta.etag.substr(0, UINT16_MAX), modified = meta.last_modified.substr(0, UINT16_MAX);
+            Record r = { RECORD_MAGIC, id.x, id.y, id.z, {}, meta.fetched, static_cast<uint16_t>(etag.size()),
+                static_cast<uint16_t>(modified.size()), static_cast<uint32_t>(data.size()) };
+            std::memcpy(r.udt, udt, sizeof(udt));
+            pending.append((const char*)&r, sizeof(r));
+            pending += etag;
+            pending += modified;
+            pending += data;
+            uint32_t head = sizeof(Record) + r.etag_size + r.modified_size;
+            // A replaced record stays in the pack until the next compaction
+            index[id] = { pack_size, r.size, head, ++tick, meta.fetched };
+            pack_size += head + r.size;
+
+            if (pending.size() >= FLUSH_BYTES) {
+                flush();
+            }
+            if (pack_size > max_size) {
+                start_compaction();
+            }
+        }
+
+        // Record a successful revalidation
+        void touch(TiltId id, int64_t fetched) {
+            if (auto it = index.find(id); it != index.end()) {
+                it->second.fetched = fetched;
+            }
+        }
+
+        uint64_t bytes() const { return pack_size; }
+    };
+
+    // Disk cache tier, keeping every tilt loaded below it
+    class DiskProvider : public TiltProvider {
+        TiltsDiskCache disk;
+        metrics::Counter& hits = metrics::registry().counter("tilts.disk.hits");
+        metrics::Counter& misses = metrics::registry().counter("tilts.disk.misses");
+
+    protected:
+        TiltData find(TiltId id) override { return disk.get(id); }
+        bool has(TiltId id) override { return disk.has(id); }
+
+    public:
+        DiskProvider(const std::string& dir, uint64_t max_size, std::unique_ptr<TiltProvider> next = nullptr)
+            : TiltProvider(std::move(next)), disk(dir, TiltId{}.UDT, max_size) {}
+
+        // Stale tilts are served as they are while a lower tier revalidates them
+        // Only loads are counted, not the peeks of fallback tilts
+        TiltData get(TiltId id) override {
+            auto td = find(id);
+            (td.size ? hits : misses).add();
+            if (!td.size) {
+                return next ? next->get(id) : td;
+            }
+            if (auto m = disk.meta(id); next && m && TiltMeta::now() - m->fetched > TILT_MAX_AGE) {
+                next->revalidate(id, *m);
+            }
+            return td;
+        }
+
+        void store(TiltId id, const TiltBuffer& data, const TiltMeta& meta) override {
+            if (data) {
+                disk.put(id, *data, meta);
+            } else {
+                disk.touch(id, meta.fetched);
+            }
+        }
+
+        // Tilts stored on the way up reach the disk in one write per poll
+        std::tuple<bool, size_t> poll(const Deliver& deliver = {}) override {
+            auto result = TiltProvider::poll(deliver);
+            disk.commit();
+            return result;
+        }
+
+        uint64_t diskBytes() const override { return disk.bytes() + TiltProvider::diskBytes(); }
+    };
+} // namespace tilts
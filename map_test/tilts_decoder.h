@@ -0,0 +1,140 @@
+#pragma once
+//
+//  tilts_decoder.h
+//
+//  Background stage decoding png tilts into ready-to-blit images
+//  Tilts are handed back to the UI thread at their native size, scaling is left to the compositor
+//
+
+#include "tilts.h"
+#include "metrics.h"
+
+namespace tilts {
+    // Default number of decoding threads
+    const int DECODE_WORKERS = 2;
+
+    struct DecodedTilt {
+        TiltId id;
+        TiltData png;
+        // Decoded image, owned by whoever takes it from the decoder
+        Fl_Image* image = nullptr;
+        // Link in the completion queue
+        DecodedTilt* next = nullptr;
+
+        DecodedTilt(TiltId id, TiltData td)
+            : id(id), png(td.retain()) {}
+    };
+
+    class TiltDecoder {
+        std::vector<std::thread> workers;
+        std::deque<DecodedTilt*> jobs;
+        CompletionQueue<DecodedTilt> done;
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stopping = false;
+        // Requests not yet taken back, only touched by the UI thread
+        std::set<TiltId> pending;
+        metrics::Histogram& decode_time = metrics::registry().histogram("tilts.decode_us");
+        metrics::Gauge& queued = metrics::registry().gauge("tilts.decodes_pending");
+
+        void work() {
+            while (true) {
+                DecodedTilt* job;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    job = jobs.front();
+                    jobs.pop_front();
+                }
+                {
+                    metrics::ScopedTimer timer(decode_time);
+                    auto png = new Fl_PNG_Image(nullptr, job->png.buf, static_cast<int>(job->png.size));
+                    if (png->fail()) {
+                        delete png;
+                    } else {
+                        job->image = png;
+                    }
+                }
+                job->png = TiltData();
+                done.push(job);
+            }
+        }
+
+    public:
+        TiltDecoder(int concurrency = DECODE_WORKERS) {
+            for (int i = 0; i < std::max(concurrency, 1); i++) {
+                workers.emplace_back(&TiltDecoder::work, this);
+            }
+        }
+
+        ~TiltDecoder() {
+            shutdown();
+            for (auto t = done.drain(); t;) {
+                auto next = t->next;
+                delete t->image;
+                delete t;
+                t = next;
+            }
+        }
+
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (stopping) {
+                    return;
+                }
+                stopping = true;
+                for (auto t : jobs) {
+                    delete t;
+                }
+                jobs.clear();
+            }
+            cv.notify_all();
+            for (auto& th : workers) {
+                th.join();
+            }
+        }
+
+        // Called from a decoding thread when decoded tilts are ready to poll
+        void setWakeup(const std::function<void()>& wake) { done.notify = wake; }
+
+        bool isDecoding(TiltId id) const { return pending.find(id) != pending.end(); }
+        bool busy() const { return !pending.empty(); }
+
+        // Queue a tilt for decoding, sharing the png data or copying it when the view is not owned
+        void request(TiltId id, TiltData td) {
+            if (td.size == 0 || !pending.insert(id).second) {
+                return;
+            }
+            queued.set(pending.size());
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                jobs.push_back(new DecodedTilt(id, td));
+            }
+            cv.notify_one();
+        }
+
+        // Hand every finished tilt to `take`, which returns whether it keeps the image
+        // Returns the number of images kept
+        template <typename F>
+        size_t poll(F&& take) {
+            size_t kept = 0;
+            for (auto t = done.drain(); t;) {
+                pending.erase(t->id);
+                if (t->image && take(*t)) {
+                    kept++;
+                } else {
+                    delete t->image;
+                }
+                auto next = t->next;
+                delete t;
+                t = next;
+            }
+            queued.set(pending.size());
+            return kept;
+        }
+    };
+} // namespace tilts
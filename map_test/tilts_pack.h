@@ -0,0 +1,167 @@
+#pragma once
+//
+//  tilts_pack.h
+//
+//  Read-only tilt archives for seeding caches and offline use
+//  A pack holds png data followed by a directory sorted by quadkey, found with one binary search
+//
+
+#include "tilts.h"
+#include "tilts_provider.h"
+
+namespace tilts {
+
+    class TiltPack {
+        static constexpr uint32_t PACK_MAGIC = 0x4b415054;  // "TPAK"
+        static constexpr uint32_t PACK_VERSION = 1;
+
+        struct Header {
+            uint32_t magic;
+            uint32_t version;
+            char udt[8];
+            uint64_t count;
+            uint64_t dir_offset;
+        };
+        struct DirEntry {
+            uint64_t quadkey;
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        httplib::detail::mmap file;
+        Header header = {};
+        const char* dir = nullptr;
+
+        DirEntry entry(uint64_t i) const {
+            DirEntry e;
+            std::memcpy(&e, dir + i * sizeof(DirEntry), sizeof(e));
+            return e;
+        }
+
+    public:
+        // Sort key: level first, then Morton order so that nearby tilts stay close in the pack
+        static uint64_t quadkey(TiltId id) {
+            uint64_t m = 0;
+            for (int b = 0; b < 29; b++) {
+                m |= (uint64_t(id.x >> b & 1) << (2 * b + 1)) | (uint64_t(id.y >> b & 1) << (2 * b));
+            }
+            return uint64_t(id.z) << 58 | m;
+        }
+
+        TiltPack(const std::string& path) : file(path.c_str()) {
+            if (!file.is_open() || file.size() < sizeof(Header)) {
+                return;
+            }
+            std::memcpy(&header, file.data(), sizeof(Header));
+            if (header.magic != PACK_MAGIC || header.version != PACK_VERSION ||
+                header.dir_offset + header.count * sizeof(DirEntry) > file.size()) {
+                header.count = 0;
+                return;
+            }
+            dir = file.data() + header.dir_offset;
+#if DEBUG
+            std::cout << "Mounted tilt pack " << path << " with " << header.count << " tilts" << std::endl;
+#endif // DEBUG
+        }
+
+        bool valid() const { return dir != nullptr; }
+        size_t size() const { return header.count; }
+        std::string version() const { return std::string(header.udt, strnlen(header.udt, sizeof(header.udt))); }
+
+        // Zero-copy view of a tilt, empty when not in the pack
+        TiltData get(TiltId id) const {
+            auto key = quadkey(id);
+            uint64_t lo = 0, hi = header.count;
+            while (lo < hi) {
+                auto mid = (lo + hi) / 2;
+                if (entry(mid).quadkey < key) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == header.count) {
+                return TiltData();
+            }
+            auto e = entry(lo);
+            if (e.quadkey != key || e.offset + e.size > file.size()) {
+                return TiltData();
+            }
+            return TiltData((const unsigned char*)file.data() + e.offset, e.size);
+        }
+
+        bool has(TiltId id) const { return get(id).size != 0; }
+
+        // Build a pack of every tilt within mercator bounds [x1, x2] * [y1, y2] on levels [z1, z2]
+        // `fetch` returns the png data of a tilt, or an empty string to leave it out
+        // Returns the number of tilts written
+        static size_t build(const std::string& path, double x1, double y1, double x2, double y2, int z1, int z2,
+            const std::function<std::string(TiltId)>& fetch) {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                return 0;
+            }
+            Header h = { PACK_MAGIC, PACK_VERSION, {}, 0, sizeof(Header) };
+            std::strncpy(h.udt, TiltId{}.UDT, sizeof(h.udt));
+            out.write((const char*)&h, sizeof(h));
+
+            std::vector<DirEntry> entries;
+            for (int z = z1; z <= z2; z++) {
+                int n = 1 << z;
+                int i1 = std::clamp(int(x1 * n), 0, n - 1), i2 = std::clamp(int(x2 * n), 0, n - 1);
+                int j1 = std::clamp(int(y1 * n), 0, n - 1), j2 = std::clamp(int(y2 * n), 0, n - 1);
+                for (int i = i1; i <= i2; i++) {
+                    for (int j = j1; j <= j2; j++) {
+                        TiltId id{ .x = i, .y = j, .z = z };
+                        auto data = fetch(id);
+                        if (data.empty()) {
+                            continue;
+                        }
+                        entries.push_back({ quadkey(id), h.dir_offset, data.size() });
+                        out.write(data.data(), data.size());
+                        h.dir_offset += data.size();
+                    }
+                }
+#if DEBUG
+                std::cout << "Packed level " << z << ", " << entries.size() << " tilts so far" << std::endl;
+#endif // DEBUG
+            }
+
+            std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.quadkey < b.quadkey; });
+            out.write((const char*)entries.data(), entries.size() * sizeof(DirEntry));
+            h.count = entries.size();
+            out.seekp(0);
+            out.write((const char*)&h, sizeof(h));
+            return out ? entries.size() : 0;
+        }
+    };
+
+    // Read-only tier of mounted packs, searched in mounting order
+    // Views keep their pack mapped
+    class PackProvider : public TiltProvider {
+        std::vector<std::shared_ptr<TiltPack>> packs;
+
+    protected:
+        TiltData find(TiltId id) override {
+            for (auto& p : packs) {
+                if (auto td = p->get(id); td.size) {
+                    td.owner = p;
+                    return td;
+                }
+            }
+            return TiltData();
+        }
+
+    public:
+        PackProvider(std::unique_ptr<TiltProvider> next = nullptr) : TiltProvider(std::move(next)) {}
+
+        bool mount(const std::string& path) {
+            auto pack = std::make_shared<TiltPack>(path);
+            if (!pack->valid()) {
+                return false;
+            }
+            packs.push_back(std::move(pack));
+            return true;
+        }
+    };
+} // namespace tilts
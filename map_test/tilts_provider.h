@@ -0,0 +1,234 @@
+#pragma once
+//
+//  tilts_provider.h
+//
+//  Tilt providers, chained from the fastest tier to the slowest one
+//  A provider answers from its own storage and passes misses to the next tier,
+//  tilts loaded by a lower tier are handed back up through every tier above it
+//
+
+#include "tilts.h"
+#include "lru_cache.h"
+#include "metrics.h"
+
+namespace tilts {
+    // Receives a tilt loaded by a lower tier, with null data when a revalidation found it unchanged
+    using Deliver = std::function<void(TiltId, const TiltBuffer&, const TiltMeta&)>;
+
+    class TiltProvider {
+    protected:
+        // Lower tier, asked when this one misses
+        std::unique_ptr<TiltProvider> next;
+
+        // Lookup in this tier only
+        virtual TiltData find(TiltId id) { return TiltData(); }
+        virtual bool has(TiltId id) { return find(id).size != 0; }
+
+    public:
+        TiltProvider(std::unique_ptr<TiltProvider> next = nullptr) : next(std::move(next)) {}
+        virtual ~TiltProvider() = default;
+
+        // Data available right away, without loading it when missing
+        virtual TiltData peek(TiltId id) {
+            auto td = find(id);
+            return td.size || !next ? td : next->peek(id);
+        }
+
+        // Data available right away, otherwise start loading it
+        virtual TiltData get(TiltId id) {
+            auto td = find(id);
+            return td.size || !next ? td : next->get(id);
+        }
+
+        // Start loading a tilt that is not on screen yet, if the budget allows
+        // Returns whether loading started
+        virtual bool prefetch(TiltId id) { return !has(id) && next && next->prefetch(id); }
+
+        // Keep a tilt loaded by a lower tier, or refresh its fetch time when `data` is null
+        virtual void store(TiltId id, const TiltBuffer& data, const TiltMeta& meta) {}
+
+        // Check a cached tilt against its origin in the background, the result is delivered through poll()
+        virtual void revalidate(TiltId id, const TiltMeta& meta) {
+            if (next) {
+                next->revalidate(id, meta);
+            }
+        }
+
+        // Collect tilts loaded in the background, storing them in every tier on the way up
+        // Returns whether loading is still pending and how many tilts arrived
+        virtual std::tuple<bool, size_t> poll(const Deliver& deliver = {}) {
+            if (!next) {
+                return { false, 0 };
+            }
+            return next->poll([&](TiltId id, const TiltBuffer& data, const TiltMeta& meta) {
+                store(id, data, meta);
+                if (deliver) {
+                    deliver(id, data, meta);
+                }
+            });
+        }
+
+        // Visible region, for ordering and dropping pending loads
+        virtual void setViewport(const TiltViewport& v) {
+            if (next) {
+                next->setViewport(v);
+            }
+        }
+
+        // Called from background threads when loaded tilts are ready to poll
+        virtual void setWakeup(const std::function<void()>& wake) {
+            if (next) {
+                next->setWakeup(wake);
+            }
+        }
+
+        // Seconds until a failed load may be retried, none when nothing waits
+        // Retries are not signalled through the wakeup
+        virtual std::optional<double> nextRetry() const { return next ? next->nextRetry() : std::nullopt; }
+
+        // Stop loading, waiting for background work to exit
+        virtual void shutdown() {
+            if (next) {
+                next->shutdown();
+            }
+        }
+
+        // Bytes of compressed tilts held in memory and on disk by the chain
+        virtual size_t memoryBytes() const { return next ? next->memoryBytes() : 0; }
+        virtual uint64_t diskBytes() const { return next ? next->diskBytes() : 0; }
+        virtual void setMemoryBudget(size_t bytes) {
+            if (next) {
+                next->setMemoryBudget(bytes);
+            }
+        }
+    };
+
+    // Default memory budget for compressed tilts
+    const size_t MEMORY_CACHE_SIZE = 64ull << 20;
+    // Share of the memory budget prefetched tilts not on screen yet may take, so they cannot push out visible ones
+    const double MEMORY_PREFETCH_SHARE = 0.25;
+
+    // Compressed tilts in memory, least recently used ones dropped beyond the budget
+    // Buffers are shared, so views handed out stay valid after eviction
+    class MemoryProvider : public TiltProvider {
+        using clock = std::chrono::steady_clock;
+        // Prefetches never arriving are forgotten after this long
+        static constexpr auto PREFETCH_EXPIRY = std::chrono::seconds(60);
+
+        cache::LruCache<TiltBuffer> tilts;
+        // Prefetches in flight with their start, and prefetched tilts not asked for yet with their size
+        std::map<TiltId, clock::time_point> prefetching;
+        std::map<TiltId, size_t> unused;
+        size_t unused_bytes = 0;
+        metrics::Counter& hits = metrics::registry().counter("tilts.memory.hits");
+        metrics::Counter& misses = metrics::registry().counter("tilts.memory.misses");
+
+    protected:
+        TiltData find(TiltId id) override {
+            auto data = tilts.find(id.key());
+            return data ? TiltData(*data) : TiltData();
+        }
+        bool has(TiltId id) override { return tilts.peek(id.key()) != nullptr; }
+
+        bool prefetch_full() const { return unused_bytes >= tilts.capacity() * MEMORY_PREFETCH_SHARE; }
+
+        // Forget prefetched tilts evicted since, and prefetches that never arrived
+        void prune() {
+            for (auto it = unused.begin(); it != unused.end();) {
+                if (tilts.peek(it->first.key())) {
+                    ++it;
+                    continue;
+                }
+                unused_bytes -= it->second;
+                it = unused.erase(it);
+            }
+            auto expired = clock::now() - PREFETCH_EXPIRY;
+            std::erase_if(prefetching, [&](auto& p) { return p.second < expired; });
+        }
+
+    public:
+        MemoryProvider(size_t budget, std::unique_ptr<TiltProvider> next = nullptr)
+            : TiltProvider(std::move(next)), tilts(budget) {}
+
+        // Only loads are counted, not the peeks of fallback tilts
+        TiltData get(TiltId id) override {
+            auto td = find(id);
+            (td.size ? hits : misses).add();
+            // Asked for, so no longer held against the prefetch share
+            prefetching.erase(id);
+            if (auto it = unused.find(id); it != unused.end()) {
+                unused_bytes -= it->second;
+                unused.erase(it);
+            }
+            if (td.size || !next) {
+                return td;
+            }
+            // Tilts from lower tiers are kept here too, so an evicted decode does not read the disk again
+            td = next->get(id);
+            if (!td.size) {
+                return td;
+            }
+            auto data = std::make_shared<const std::string>((const char*)td.buf, td.size);
+            store(id, data, TiltMeta());
+            return TiltData(data);
+        }
+
+        // Prefetching stops while prefetched tilts fill their share of the budget
+        bool prefetch(TiltId id) override {
+            if (has(id) || !next) {
+                return false;
+            }
+            if (prefetch_full()) {
+                prune();
+                if (prefetch_full()) {
+                    return false;
+                }
+            }
+            if (!next->prefetch(id)) {
+                return false;
+            }
+            prefetching[id] = clock::now();
+            return true;
+        }
+
+        void store(TiltId id, const TiltBuffer& data, const TiltMeta&) override {
+            if (!data) {
+                return;
+            }
+            tilts.put(id.key(), data, data->size());
+            if (prefetching.erase(id) && unused.try_emplace(id, data->size()).second) {
+                unused_bytes += data->size();
+            }
+        }
+
+        size_t memoryBytes() const override { return tilts.cost() + TiltProvider::memoryBytes(); }
+        void setMemoryBudget(size_t bytes) override { tilts.set_capacity(bytes); }
+    };
+
+    // Tilts stored as <dir>/<z>/<x>/<y>.png, as written by common tile downloaders
+    class DirectoryProvider : public TiltProvider {
+        std::filesystem::path dir;
+
+        std::filesystem::path path(TiltId id) const {
+            return dir / std::to_string(id.z) / std::to_string(id.x) / (std::to_string(id.y) + ".png");
+        }
+
+    protected:
+        TiltData find(TiltId id) override {
+            std::ifstream in(path(id), std::ios::binary);
+            if (!in) {
+                return TiltData();
+            }
+            return TiltData(std::make_shared<const std::string>(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>()));
+        }
+        bool has(TiltId id) override {
+            std::error_code ec;
+            return std::filesystem::exists(path(id), ec);
+        }
+
+    public:
+        DirectoryProvider(const std::string& dir, std::unique_ptr<TiltProvider> next = nullptr)
+            : TiltProvider(std::move(next)), dir(dir) {}
+    };
+} // namespace tilts
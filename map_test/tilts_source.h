@@ -0,0 +1,244 @@
+#pragma once
+//
+//  tilts_source.h
+//
+//  Tilt source downloading from the tile server, and the default chain of tiers in front of it:
+//  memory, mounted packs, disk, then HTTP
+//
+
+#include "tilts.h"
+#include "tilts_provider.h"
+#include "tilts_cache.h"
+#include "tilts_pack.h"
+#include "metrics.h"
+
+namespace tilts {
+    // Delay before retrying a failed download in seconds, doubled after each failure
+    const double RETRY_DELAY = 0.5, RETRY_DELAY_MAX = 60;
+    // Seconds a missing (404) tilt is remembered
+    const double NOT_FOUND_TTL = 30;
+
+    struct DownloadStats {
+        size_t succeeded = 0, failed = 0, not_found = 0, retried = 0, cancelled = 0, not_modified = 0;
+        uint64_t bytes = 0;
+    };
+
+    class HttpProvider : public TiltProvider {
+        using clock = std::chrono::steady_clock;
+        // Failures of a tilt and when it may be downloaded again
+        struct RetryState {
+            int failures;
+            clock::time_point next;
+        };
+
+        CompletionQueue<TiltFuture> done;
+        std::set<TiltId> downloading;
+        std::map<TiltId, RetryState> retries;
+        // Earliest pending retry, to wake the UI for it
+        std::optional<clock::time_point> next_retry;
+        std::mt19937 jitter{ std::random_device{}() };
+        DownloadStats stats;
+        size_t in_flight = 0;
+        // Prefetching stops when this many downloads are in flight
+        size_t prefetch_limit;
+        TiltDownloader downloader;
+        metrics::Histogram& latency = metrics::registry().histogram("tilts.download_us");
+        metrics::Gauge& queued = metrics::registry().gauge("tilts.downloads_in_flight");
+
+    public:
+        // Called for every finished download with its status, seconds since queued and size in bytes
+        std::function<void(TiltId, int, double, size_t)> on_download;
+
+        HttpProvider(const std::vector<std::string>& hosts = TILT_HOSTS, int workers = DOWNLOAD_WORKERS)
+            : prefetch_limit(workers * 4), downloader(hosts, workers, done) {}
+
+        ~HttpProvider() {
+            shutdown();
+            for (auto f = done.drain(); f;) {
+                auto next = f->next;
+                delete f;
+                f = next;
+            }
+        }
+
+        // Stop downloading, waiting for all workers to exit
+        void shutdown() override { downloader.shutdown(); }
+
+        void setWakeup(const std::function<void()>& wake) override { done.notify = wake; }
+
+        std::optional<double> nextRetry() const override {
+            if (!next_retry) {
+                return std::nullopt;
+            }
+            return std::max(std::chrono::duration<double>(*next_retry - clock::now()).count(), 0.0);
+        }
+
+        bool isDownloading(TiltId id) {
+            return downloading.find(id) != downloading.end();
+        }
+
+        // Failed downloads wait for their backoff to pass
+        bool isBackingOff(TiltId id) {
+            auto it = retries.find(id);
+            return it != retries.end() && clock::now() < it->second.next;
+        }
+
+        const DownloadStats& downloadStats() const { return stats; }
+
+        void download(TiltId id) {
+            if (isDownloading(id) || isBackingOff(id)) {
+                return;
+            }
+            if (retries.find(id) != retries.end()) {
+                stats.retried++;
+            }
+
+            downloader.push(new TiltFuture(id));
+            downloading.insert(id);
+            in_flight++;
+            queued.set(in_flight);
+        }
+
+        // Conditional download of a cached tilt, sending its validators
+        void revalidate(TiltId id, const TiltMeta& meta) override {
+            if (isDownloading(id) || isBackingOff(id)) {
+                return;
+            }
+            auto future = new TiltFuture(id);
+            future->meta = meta;
+            future->revalidate = true;
+            downloader.push(future);
+            downloading.insert(id);
+            in_flight++;
+            queued.set(in_flight);
+        }
+
+        // Download a tilt that is not on screen yet, if the bandwidth budget allows
+        // Returns whether a new download was queued
+        bool prefetch(TiltId id) override {
+            if (in_flight >= prefetch_limit || isDownloading(id) || isBackingOff(id)) {
+                return false;
+            }
+            download(id);
+            return true;
+        }
+
+        // Schedule the next attempt of a failed download, with exponential backoff and jitter
+        void backoff(TiltId id, int status) {
+            auto& r = retries.try_emplace(id, RetryState{ 0, {} }).first->second;
+            r.failures++;
+            double delay = status == 404 ? NOT_FOUND_TTL
+                : std::min(RETRY_DELAY * std::ldexp(1.0, r.failures - 1), RETRY_DELAY_MAX);
+            delay *= std::uniform_real_distribution<double>(0.5, 1.0)(jitter);
+            r.next = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(delay));
+            if (!next_retry || r.next < *next_retry) {
+                next_retry = r.next;
+            }
+        }
+
+        // Collect every finished download, handing downloaded tilts to `deliver`
+        // Returns whether downloads or retries are still pending,
+        // and how many tilts arrived or became ready to retry
+        std::tuple<bool, size_t> poll(const Deliver& deliver = {}) override {
+            size_t arrived = 0;
+            for (auto f = done.drain(); f;) {
+                in_flight--;
+                downloading.erase(f->id);
+                auto elapsed = clock::now() - f->queued;
+                if (on_download && f->status != STATUS_CANCELLED) {
+                    on_download(f->id, f->status, std::chrono::duration<double>(elapsed).count(), f->data.size());
+                }
+                if (f->status == 200) {
+                    latency.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+                    stats.bytes += f->data.size();
+                    // The response body moves into a shared buffer, every tier above keeps a reference
+                    auto data = std::make_shared<const std::string>(std::move(f->data));
+                    if (deliver) {
+                        deliver(f->id, data, f->meta);
+                    }
+                    retries.erase(f->id);
+                    stats.succeeded++;
+                    arrived++;
+#if DEBUG
+                    std::cout << "Downloaded tilt " << f->id << std::endl;
+#endif // DEBUG
+
+                } else if (f->status == 304) {
+                    // Cached data is still current, only its fetch time changes
+                    if (deliver) {
+                        deliver(f->id, nullptr, f->meta);
+                    }
+                    retries.erase(f->id);
+                    stats.not_modified++;
+
+                } else if (f->status == STATUS_CANCELLED) {
+                    stats.cancelled++;
+
+                    // invalid status code
+                } else {
+                    (f->status == 404 ? stats.not_found : stats.failed)++;
+                    backoff(f->id, f->status);
+#if DEBUG
+                    std::cout << "Download tilt " << f->id
+                        << " failed with status code" << f->status << std::endl;
+#endif // DEBUG
+                }
+
+                auto next = f->next;
+                delete f;
+                f = next;
+            }
+
+            // Wake up for retries whose backoff has passed
+            if (next_retry && clock::now() >= *next_retry) {
+                auto now = clock::now();
+                next_retry.reset();
+                for (auto it = retries.begin(); it != retries.end();) {
+                    if (it->second.next > now) {
+                        if (!next_retry || it->second.next < *next_retry) {
+                            next_retry = it->second.next;
+                        }
+                        ++it;
+                    } else if (now - it->second.next > std::chrono::seconds(static_cast<int>(RETRY_DELAY_MAX))) {
+                        // Long forgotten failures
+                        it = retries.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                arrived++;
+            }
+            queued.set(in_flight);
+            return { in_flight > 0 || next_retry, arrived };
+        }
+
+        // Prioritise downloads around the viewport and drop those no longer needed
+        void setViewport(const TiltViewport& v) override { downloader.setViewport(v); }
+
+        // Nothing is available before it is downloaded
+        TiltData get(TiltId id) override {
+            download(id);
+            return TiltData();
+        }
+    };
+
+    // Memory, then mounted packs, then the disk cache in front of the tile server
+    // An empty cache path leaves out the disk cache
+    inline std::unique_ptr<TiltProvider> default_source(const std::vector<std::string>& packs = {},
+        const std::vector<std::string>& hosts = TILT_HOSTS, const std::string& cache_path = DISK_CACHE_PATH) {
+        std::unique_ptr<TiltProvider> chain = std::make_unique<HttpProvider>(hosts);
+        if (!cache_path.empty()) {
+            chain = std::make_unique<DiskProvider>(cache_path, DISK_CACHE_SIZE, std::move(chain));
+        }
+        if (!packs.empty()) {
+            auto pack = std::make_unique<PackProvider>(std::move(chain));
+            for (auto& p : packs) {
+                if (!pack->mount(p)) {
+                    std::cout << "Invalid tilt pack " << p << std::endl;
+                }
+            }
+            chain = std::move(pack);
+        }
+        return std::make_unique<MemoryProvider>(MEMORY_CACHE_SIZE, std::move(chain));
+    }
+} // namespace tilts
@@ -0,0 +1,105 @@
+#pragma once
+//
+//  tilts_synth.h
+//
+//  Procedurally generated png tilts, for benchmarks and testing without the tile server
+//
+
+#include "tilts.h"
+#include "tilts_provider.h"
+
+namespace tilts {
+
+    inline uint32_t crc32(const unsigned char* p, size_t n, uint32_t crc = 0) {
+        static const auto table = [] {
+            std::array<uint32_t, 256> t;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < n; i++) {
+            crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    // A TILT_SIZE square, two-colour png of a tilt: a grid whose colours and offset depend on the tilt
+    // Padded with an ancillary chunk to at least `bytes`, so transfer sizes can be controlled
+    inline std::string synthetic_png(TiltId id, size_t bytes = 0) {
+        std::string png("\x89PNG\r\n\x1a\n", 8);
+        auto put32 = [](std::string& s, uint32_t v) {
+            for (int b = 24; b >= 0; b -= 8) {
+                s.push_back(static_cast<char>(v >> b & 0xff));
+            }
+        };
+        auto chunk = [&](const char* type, const std::string& data) {
+            put32(png, static_cast<uint32_t>(data.size()));
+            std::string body = type + data;
+            png += body;
+            put32(png, crc32((const unsigned char*)body.data(), body.size()));
+        };
+
+        // 1-bit palette image
+        std::string ihdr;
+        put32(ihdr, TILT_SIZE);
+        put32(ihdr, TILT_SIZE);
+        ihdr += std::string("\x01\x03\x00\x00\x00", 5);
+        chunk("IHDR", ihdr);
+
+        uint32_t h = static_cast<uint32_t>(id.key() * 0x9e3779b97f4a7c15ull >> 32);
+        std::string plte = { char(240), char(236), char(228), char(h & 0x7f), char(h >> 8 & 0x7f), char(h >> 16 & 0x7f) };
+        chunk("PLTE", plte);
+
+        // Rows with filter byte 0, then a stored (uncompressed) zlib stream
+        const int row = TILT_SIZE / 8 + 1;
+        std::string raw(static_cast<size_t>(row) * TILT_SIZE, '\0');
+        int shift = h % 32;
+        for (int y = 0; y < TILT_SIZE; y++) {
+            for (int x = 0; x < TILT_SIZE; x++) {
+                if ((x + shift) % 32 == 0 || (y + shift) % 32 == 0 || x == y) {
+                    raw[y * row + 1 + x / 8] |= char(0x80 >> (x % 8));
+                }
+            }
+        }
+        std::string idat("\x78\x01", 2);
+        for (size_t off = 0; off < raw.size(); off += 0xffff) {
+            auto len = static_cast<uint16_t>(std::min<size_t>(0xffff, raw.size() - off));
+            idat.push_back(off + len == raw.size() ? 1 : 0);
+            idat += { char(len & 0xff), char(len >> 8), char(~len & 0xff), char(~len >> 8 & 0xff) };
+            idat.append(raw, off, len);
+        }
+        uint32_t a = 1, b = 0;
+        for (unsigned char c : raw) {
+            a = (a + c) % 65521;
+            b = (b + a) % 65521;
+        }
+        put32(idat, b << 16 | a);
+        chunk("IDAT", idat);
+
+        // Private ancillary chunk, ignored by decoders
+        const size_t overhead = 2 * 12;
+        if (bytes > png.size() + overhead) {
+            chunk("paDd", std::string(bytes - png.size() - overhead, '\0'));
+        }
+        chunk("IEND", "");
+        return png;
+    }
+
+    // Every tilt generated on request, for benchmarks and runs without the network
+    class SyntheticProvider : public TiltProvider {
+        size_t bytes;
+
+    protected:
+        TiltData find(TiltId id) override { return TiltData(std::make_shared<const std::string>(synthetic_png(id, bytes))); }
+        bool has(TiltId id) override { return true; }
+
+    public:
+        SyntheticProvider(size_t bytes = 0) : bytes(bytes) {}
+    };
+} // namespace tilts